@@ -1,290 +1,3475 @@
+#define _GNU_SOURCE
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "Malloc.h"
 
-#define NUM_BLOCKS (BUDDY_MEMORY_SIZE / MIN_BLOCK_SIZE)
-#define TOTAL_NODES (2 * NUM_BLOCKS - 1)
-#define BITMAP_SIZE ((TOTAL_NODES + 7) / 8)
+#define CACHE_MAX_ORDERS 6 // Most buddy orders served by the thread caches, the small path may need fewer
+#define CACHE_SIZE 64     // Blocks a thread cache holds per order
+#define CACHE_BATCH 32    // Blocks moved between a thread cache and the buddy memory at once
+#define MAX_ARENAS 64     // Most arenas the reserved range can hold, created on demand
+#define MAX_CPUS 256      // Cpus that get their own arena, higher cpu numbers share them
+#define SLAB_SIZE PAGE_SIZE // Slabs are buddy blocks of one page
+#define SLAB_HEADER_SIZE 128 // Objects start after the header, a multiple of every class keeps them aligned to their size
+#define SLAB_MAP_WORDS (((SLAB_SIZE - SLAB_HEADER_SIZE) / (1 << SLAB_MIN_SHIFT) + 63) / 64)
+#define CACHE_CLASSES (SLAB_CLASSES + CACHE_MAX_ORDERS) // Size classes of the thread caches: the slab classes, then the buddy orders
+#define LARGE_CACHE_BINS 256          // Large mappings up to this many pages are kept for reuse, binned by page count
+#define LARGE_CACHE_SLOTS 128         // Large mappings the cache can hold at once
+#define LARGE_CACHE_BUDGET (8 << 20)  // Default bytes of cached large mappings allowed to stay resident
+#define HUGE_PAGE_SIZE (2 << 20)      // Size of a huge page, transparent or from hugetlbfs
+#define BUDDY_GROW_MAX_SIZE (16 << 10) // Largest size a buddy block grows to in place, beyond it realloc moves to large_alloc
+#define BULK_BATCH 256                // Most blocks the bulk functions move to or from the arenas under one lock
+#define LARGE_MAP_MIN_SLOTS 256       // Initial slots of the table of large mappings
+#define COMMIT_SIZE (1 << 20)         // Default bytes committed when an arena is created
+#define STATS_CLASSES (SLAB_CLASSES + MAX_LEVELS) // Size classes counted by the statistics: the slab classes, then every buddy order
+#define STATS_FLUSH_BYTES (64 << 10)  // Bytes a thread allocates or frees before it updates the shared peak usage
+#define TRACE_RING_RECORDS 4096       // Trace records a thread buffers before writing them to the trace file
+#define POOL_BLOCK_SIZE (16 << 10)    // Smallest block a pool carves into objects
+#define POOL_MIN_OBJECTS 8            // Objects a pool block holds at least, larger objects get larger blocks
+#define REGION_CHUNK_SIZE (16 << 10)  // Default size of the first chunk of a region
+#define REGION_MAX_CHUNK_SIZE (4 << 20) // Chunks of a region double up to this size, larger requests get a chunk of their own
+#define REGION_ALIGN 16               // Alignment of the allocations of a region, the one of max_align_t
+#define MAX_ARENA_SIZE ((size_t)1 << (sizeof(size_t) == 4 ? 28 : 34)) // Largest arena, the reserved range must fit the address space
+
+_Static_assert(MAX_LEVELS <= 32, "free_order_mask has one bit per order");
+_Static_assert(STATS_SLAB_CLASSES == SLAB_CLASSES, "MallocStats has one counter per slab class");
+_Static_assert(SLAB_HEADER_SIZE % SLAB_MAX_SIZE == 0, "Slab objects must be aligned to their size class");
 
 #define DEBUG
 
-// An array of bytes used as a bitmap to track the allocation status of each block of memory.
-static unsigned char buddy_bitmap[BITMAP_SIZE] = {0}; // Pointer to the start of the allocated memory region
-static void *buddy_memory;
+// A free block of buddy memory, the free list links are stored inside the block itself
+typedef struct FreeBlock
+{
+	struct FreeBlock *next;
+	struct FreeBlock *prev;
+	// Time the block was freed while its pages were resident, 0 once they were given back to the kernel
+	uint64_t dirty_since;
+} FreeBlock;
+
+// A block freed by a thread of another arena, waiting on the remote free list of its own arena
+typedef struct RemoteBlock
+{
+	struct RemoteBlock *next;
+	int order;
+} RemoteBlock;
+
+// Header at the base of a slab, a buddy block of order slab_order carved into objects of one size class
+typedef struct Slab
+{
+	struct Slab *next;
+	struct Slab *prev;
+	int size_class;
+	int object_count;
+	int free_count;
+	// Bit i is set when object i is allocated
+	uint64_t used[SLAB_MAP_WORDS];
+} Slab;
+
+_Static_assert(sizeof(Slab) <= SLAB_HEADER_SIZE, "Slab header does not fit in SLAB_HEADER_SIZE");
+
+// A buddy arena: arena_size bytes of memory managed by its own bitmap and free lists
+typedef struct Arena
+{
+	// Lock protecting the free lists and the writes to the bitmap
+	pthread_mutex_t lock;
+	// Pointer to the start of the memory region of the arena
+	void *memory;
+	// Bytes at the start of the arena that are backed by memory. The rest is held by placeholder blocks marked
+	// as allocated: the one at offset committed is as large as everything before it, and so on up to the arena size.
+	size_t committed;
+	// Bit k is set when free_lists[k] is not empty
+	unsigned int free_order_mask;
+	// Time from which the oldest dirty free block has decayed and can be purged, 0 when there is none
+	uint64_t purge_at;
+	// Lock-free list of blocks freed by other threads, pushed with a CAS and drained under the lock
+	RemoteBlock *remote_frees;
+	// One free list per order, order k holds free blocks of min_block_size << k bytes
+	FreeBlock *free_lists[MAX_LEVELS];
+	// An array of 64-bit words used as a bitmap over the implicit binary tree of blocks.
+	// Node 1 is the whole arena, the children of node i are 2i and 2i + 1, so the buddy of node i is i ^ 1,
+	// its parent i >> 1, and both halves of a block share a word. Bit 0 is unused.
+	// A bit is set when the block is allocated or split, so free blocks and everything inside them are 0.
+	// A set node is split when one of its halves is set, and allocated when both are clear.
+	// It is sized with the geometry, so it lives in a mapping of its own with the slab map.
+	uint64_t *bitmap;
+	// Slabs of each size class that still have free objects
+	Slab *partial_slabs[SLAB_CLASSES];
+	// Bit i is set when the i-th SLAB_SIZE block of the arena is a slab
+	uint64_t *slab_map;
+} Arena;
+
+// Geometry of the arenas, chosen by init_buddy_allocator_config
+static size_t arena_size;      // Bytes of each arena, a power of two
+static int arena_shift;        // log2(arena_size)
+static size_t min_block_size;  // Bytes of an order 0 block, a power of two
+static int min_block_shift;    // log2(min_block_size)
+static int max_order;          // Order of a whole arena
+static size_t small_threshold; // Requests below it are served by the arenas, larger ones by large_alloc
+static int cache_orders;       // Buddy orders served by the thread caches
+static int slab_order;         // Order of the buddy blocks that hold slabs
+static size_t commit_size;     // Bytes committed when an arena is created
+static int max_arenas;         // Arenas the reserved range holds
+static size_t total_nodes;     // Nodes of the implicit tree of an arena
+static size_t bitmap_words;    // Words of the bitmap of an arena, one bit per node and the unused bit 0
+static size_t slab_map_words;  // Words of the slab map of an arena
+static int purge_order;        // Smallest order whose free blocks are purged, their first page holding the free list links
+
+static Arena arenas[MAX_ARENAS];
+// Number of arenas created so far, arena i lives at arena_space + i * arena_size
+static int arena_count;
+// Virtual range reserved for all the arenas, so the owner of a pointer is found with a subtraction
+static char *arena_space;
+// Back new arenas and large allocations of at least a huge page with huge pages
+static bool use_huge_pages;
+// Lock protecting the creation of arenas and the cpu to arena mapping
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+// Arena index + 1 used by each cpu, 0 while the cpu has not allocated yet
+static int cpu_arena[MAX_CPUS];
+// Arenas below this index have been handed to a cpu
+static int assigned_arenas;
+// Next slot handed out to threads when sched_getcpu is not available
+static int next_round_robin_slot;
+// Arena a thread allocates from, picked from its cpu on the first allocation
+static __thread Arena *thread_arena;
+// Bumped by destroy_buddy_allocator. The cache and the arena of a thread that last used an older generation point
+// into memory that was unmapped, they are dropped the next time the thread uses them.
+static unsigned int allocator_generation;
+
+// Per-thread magazine of small blocks and slab objects for each size class. Cached blocks stay allocated
+// in their arena, so a thread can reuse them without taking any arena lock.
+typedef struct ThreadCache
+{
+	int count[CACHE_CLASSES];
+	void *blocks[CACHE_CLASSES][CACHE_SIZE];
+	unsigned int generation; // allocator_generation the blocks and thread_arena belong to
+	bool registered;
+} ThreadCache;
+
+static __thread ThreadCache thread_cache;
+// Key whose destructor gives the cache of an exiting thread back to the arenas
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+// Value written in cached blocks to spot a double free without searching the cache every time
+static const uintptr_t CACHED_BLOCK_KEY = (uintptr_t)0x5EC0DEDB10C4CAC8ULL;
+
+// A large mapping kept after large_free for the next large_alloc of the same page count
+typedef struct LargeCacheEntry
+{
+	void *mapping;
+	size_t length;
+	// Age of the entry, smaller is older
+	unsigned long stamp;
+	// Next entry + 1 of the same bin, or of the unused slots, 0 at the end of the list
+	int next;
+	// false once the pages were handed back to the kernel with madvise
+	bool resident;
+} LargeCacheEntry;
+
+static LargeCacheEntry large_cache[LARGE_CACHE_SLOTS];
+// First entry + 1 of each bin, indexed by page count
+static int large_cache_bins[LARGE_CACHE_BINS + 1];
+// First unused slot + 1
+static int large_cache_unused;
+static size_t large_cache_budget = LARGE_CACHE_BUDGET;
+static size_t large_cache_resident;
+static unsigned long large_cache_stamp;
+static size_t large_cache_hits;
+// Nanoseconds a free arena block stays dirty before buddy_free_block purges it
+static uint64_t decay_time = (uint64_t)DECAY_TIME_MS * 1000000;
+// Bytes of free arena blocks given back to the kernel
+static size_t purged_bytes;
+static size_t large_cache_misses;
+static pthread_mutex_t large_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A mapping handed out by large_alloc, its length is kept here instead of in a header
+typedef struct LargeMapEntry
+{
+	uintptr_t mapping;
+	size_t length;
+} LargeMapEntry;
+
+// Open addressing hash table of the large mappings, keyed by address, empty slots have mapping 0
+static LargeMapEntry *large_map;
+static size_t large_map_slots;
+static size_t large_map_count;
+// Bytes of all the large mappings in the table
+static size_t large_map_bytes;
+static pthread_mutex_t large_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters of a thread. Only the thread writes them, readers of pseudo_malloc_stats add up those of every thread.
+// The bytes of the arena blocks are not counted, they follow from the block counts of each size class.
+typedef struct ThreadStats
+{
+	size_t allocs[STATS_CLASSES];
+	size_t frees[STATS_CLASSES];
+	size_t large_allocs;
+	size_t large_frees;
+	size_t large_granted_bytes;
+	size_t large_freed_bytes;
+	size_t splits;
+	size_t coalesces;
+	size_t requested_bytes;
+	// Bytes granted minus bytes freed by the thread since it last updated stats_in_use
+	long pending_bytes;
+	struct ThreadStats *next;
+	struct ThreadStats *prev;
+	bool registered;
+} ThreadStats;
+
+static __thread ThreadStats thread_stats;
+// Threads whose counters are registered, and the counters of the threads that exited
+static ThreadStats *stats_threads;
+static ThreadStats stats_retired;
+// Bytes in use as of the last update of every thread, and the most it reached
+static long stats_in_use;
+static size_t stats_peak;
+// Key whose destructor moves the counters of an exiting thread to stats_retired
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Ring of the trace records of a thread. The thread appends to it without a lock,
+// whoever writes the records out to the trace file holds flush_lock.
+typedef struct TraceRing
+{
+	TraceRecord records[TRACE_RING_RECORDS];
+	// Records appended so far, only written by the thread
+	size_t head;
+	// Records written out so far, only written under flush_lock
+	size_t tail;
+	pthread_mutex_t flush_lock;
+	struct TraceRing *next;
+} TraceRing;
+
+// Set while a trace is recorded, the calls only check it when tracing is off
+static bool trace_enabled;
+// Trace file, -1 when no trace is recorded
+static int trace_fd = -1;
+// Clock of the start of the trace, the records are timed from it
+static uint64_t trace_start;
+// Rings of every thread that recorded a call
+static TraceRing *trace_rings;
+static __thread TraceRing *thread_trace_ring;
+// Key whose destructor writes out and unmaps the ring of an exiting thread
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+// Lock protecting trace_rings and the start and stop of a trace
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*HELPER FUNCTIONS FOR BUDDY ALLOCATOR*/
 
-// Helper function to check if the bitmap is full
-int is_bitmap_full()
+// Helper function to get the cache of the calling thread, emptied along with thread_arena if the allocator was
+// destroyed since the thread last used them
+static inline ThreadCache *thread_cache_current()
 {
-	size_t bitmap_bytes = sizeof(buddy_bitmap);
-	for (size_t i = 0; i < bitmap_bytes; i++)
+	ThreadCache *cache = &thread_cache;
+	unsigned int generation = __atomic_load_n(&allocator_generation, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(cache->generation != generation, 0))
 	{
-		for (int bit = 0; bit < 8; bit++)
-		{
-			if (!(get_bitmap(i) & (1 << bit)))
-			{
-				return false;
-			}
-		}
+		memset(cache->count, 0, sizeof(cache->count));
+		cache->generation = generation;
+		thread_arena = NULL;
 	}
-	return true;
+	return cache;
+}
+
+// Helper function to check if the bitmap of the first arena is full
+int is_bitmap_full()
+{
+	return arenas[0].free_order_mask == 0;
 }
 
 // Helper function to get buddy index
 int get_buddy_index(size_t size)
 {
-	int index = 0;
-	// Find the smallest power of 2 that is greater than the requested size
-	while ((1 << index) * MIN_BLOCK_SIZE < (int)size)
-	{
-		index++;
-	}
-	return index;
+	// Smallest order such that min_block_size << order holds the size
+	int shift = pseudo_size_shift(size);
+	return shift > min_block_shift ? shift - min_block_shift : 0;
 }
 
-// Helper function to set buddy bitmap
-void set_bitmap(int index, int value)
+// Helper function to get the size class serving a request below small_threshold, as slab_alloc and buddy_alloc pick it
+static int small_size_class(size_t size)
 {
-	// Calculate the byte and bit position in the bitmap
-	int byte = index / 8;
-	int bit = index % 8;
+	return size <= SLAB_MAX_SIZE ? pseudo_slab_class(size) : SLAB_CLASSES + get_buddy_index(size);
+}
+
+// Helper function to set the bitmap of an arena
+static void arena_set_bitmap(Arena *arena, size_t index, int value)
+{
+	// Calculate the word and bit position in the bitmap
+	size_t word = index / 64;
+	size_t bit = index % 64;
 	if (value)
 	{
 		// Create a mask with the bit position set to 1
 		// Perform a bitwise OR operation to set the bit to 1
-		buddy_bitmap[byte] |= (1 << bit);
+		// Writers hold the arena lock, the atomic store keeps lock-free readers from seeing a torn word
+		__atomic_store_n(&arena->bitmap[word], arena->bitmap[word] | ((uint64_t)1 << bit), __ATOMIC_RELAXED);
 	}
 	else
 	{
 		// Create a mask with the bit position set to 0
 		// Perform a bitwise AND operation to set the bit to 0
-		buddy_bitmap[byte] &= ~(1 << bit);
+		__atomic_store_n(&arena->bitmap[word], arena->bitmap[word] & ~((uint64_t)1 << bit), __ATOMIC_RELAXED);
 	}
 }
 
-// Get the buddy bitmap
+// Get the bitmap of an arena
+static int arena_get_bitmap(Arena *arena, size_t index)
+{
+	size_t word = index / 64;
+	size_t bit = index % 64;
+	return (__atomic_load_n(&arena->bitmap[word], __ATOMIC_RELAXED) >> bit) & 1;
+}
+
+// Helper function to check that both halves of a node are clear, they share a word since the left one is even
+static bool arena_halves_free(Arena *arena, size_t index)
+{
+	size_t child = 2 * index;
+	return ((__atomic_load_n(&arena->bitmap[child / 64], __ATOMIC_RELAXED) >> (child % 64)) & 3) == 0;
+}
+
+// Helper function to set buddy bitmap of the first arena, index 0 is the whole arena like in a tree counted from 0
+void set_bitmap(int index, int value)
+{
+	arena_set_bitmap(&arenas[0], (size_t)index + 1, value);
+}
+
+// Get the buddy bitmap of the first arena, index 0 is the whole arena like in a tree counted from 0
 int get_bitmap(int index)
 {
-	int byte = index / 8;
-	int bit = index % 8;
-	return (buddy_bitmap[byte] & (1 << bit)) != 0;
+	return arena_get_bitmap(&arenas[0], (size_t)index + 1);
+}
+
+// Scalar kernel: skip the words starting at word that have every bit set
+static size_t skip_full_words_scalar(const uint64_t *words, size_t word, size_t num_words)
+{
+	while (word < num_words && words[word] == ~(uint64_t)0)
+	{
+		word++;
+	}
+	return word;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 kernel: skip fully set 256-bit spans as two 128-bit compares, the tail is left to the scalar kernel
+__attribute__((target("sse2"))) static size_t skip_full_words_sse2(const uint64_t *words, size_t word, size_t num_words)
+{
+	const __m128i ones = _mm_set1_epi32(-1);
+	while (word + 4 <= num_words)
+	{
+		__m128i low = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(words + word)), ones);
+		__m128i high = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(words + word + 2)), ones);
+		if (_mm_movemask_epi8(_mm_and_si128(low, high)) != 0xFFFF)
+		{
+			break;
+		}
+		word += 4;
+	}
+	return skip_full_words_scalar(words, word, num_words);
+}
+
+// AVX2 kernel: skip fully set 256-bit spans with one compare each, the tail is left to the scalar kernel
+__attribute__((target("avx2"))) static size_t skip_full_words_avx2(const uint64_t *words, size_t word, size_t num_words)
+{
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	while (word + 4 <= num_words)
+	{
+		__m256i span = _mm256_loadu_si256((const __m256i *)(words + word));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(span, ones)) != -1)
+		{
+			break;
+		}
+		word += 4;
+	}
+	return skip_full_words_scalar(words, word, num_words);
+}
+#endif
+
+// Kernel used by find_clear_bit, selected from the cpuid flags in init_buddy_allocator
+static size_t (*skip_full_words)(const uint64_t *, size_t, size_t) = skip_full_words_scalar;
+
+// Helper function to pick the widest bitmap kernel the cpu supports
+static void select_bitmap_kernel()
+{
+	skip_full_words = skip_full_words_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		skip_full_words = skip_full_words_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		skip_full_words = skip_full_words_sse2;
+	}
+#endif
+}
+
+// Helper function to find the first clear bit at or after from in a bitmap of num_bits bits, -1 if there is none
+static long find_clear_bit(const uint64_t *words, size_t num_bits, size_t from)
+{
+	size_t num_words = (num_bits + 63) / 64;
+	if (from >= num_bits)
+	{
+		return -1;
+	}
+	size_t word = from / 64;
+	// Bits below from in the first word count as set
+	uint64_t inverted = ~(words[word] | (((uint64_t)1 << (from % 64)) - 1));
+	if (inverted == 0)
+	{
+		word = skip_full_words(words, word + 1, num_words);
+		if (word == num_words)
+		{
+			return -1;
+		}
+		inverted = ~words[word];
+	}
+	size_t bit = word * 64 + (size_t)__builtin_ctzll(inverted);
+	return bit < num_bits ? (long)bit : -1;
 }
 
-// Helper function to find free buddy block
+// Helper function to find the first node of the first arena at or after index that is neither allocated nor split
 int find_free_buddy(int index)
 {
-	for (int i = index; i < (int)sizeof(buddy_bitmap) * 8; i++)
+	long found = find_clear_bit(arenas[0].bitmap, total_nodes + 1, (size_t)index + 1);
+	return found == -1 ? -1 : (int)(found - 1);
+}
+
+// Helper function to get the tree node of the block of the given order at the given offset
+static size_t node_index(size_t offset, int order)
+{
+	int level = max_order - order;
+	return ((size_t)1 << level) + (offset >> (min_block_shift + order));
+}
+
+// Helper function to get the offset of a pointer inside an arena, computed on uintptr_t so it stays unsigned on LP64 and ILP32
+static size_t arena_offset(const Arena *arena, const void *ptr)
+{
+	return (size_t)((uintptr_t)ptr - (uintptr_t)arena->memory);
+}
+
+// Helper function to read a cheap monotonic clock in nanoseconds, the coarse clock does not enter the kernel
+static uint64_t coarse_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Helper function to push a block on the free list of its order, dirty_since is 0 if its pages are not resident
+static void free_list_push(Arena *arena, int order, void *block, uint64_t dirty_since)
+{
+	FreeBlock *head = arena->free_lists[order];
+	FreeBlock *node = block;
+	node->prev = NULL;
+	node->next = head;
+	node->dirty_since = dirty_since;
+	if (head != NULL)
+	{
+		head->prev = node;
+	}
+	arena->free_lists[order] = node;
+	// The mask is read without the lock when looking for an arena with room
+	__atomic_store_n(&arena->free_order_mask, arena->free_order_mask | (1u << order), __ATOMIC_RELAXED);
+}
+
+// Helper function to unlink a block from the free list of its order
+static void free_list_remove(Arena *arena, int order, void *block)
+{
+	FreeBlock *node = block;
+	if (node->prev != NULL)
+	{
+		node->prev->next = node->next;
+	}
+	else
 	{
-		if (get_bitmap(i) == 0)
+		arena->free_lists[order] = node->next;
+		if (node->next == NULL)
 		{
-			return i;
+			__atomic_store_n(&arena->free_order_mask, arena->free_order_mask & ~(1u << order), __ATOMIC_RELAXED);
 		}
 	}
-	return -1;
+	if (node->next != NULL)
+	{
+		node->next->prev = node->prev;
+	}
 }
 
-// Helper function to set the children of a block
-void set_children(int index, int value)
+// Helper function to pop a block from the free list of the given order
+static void *free_list_pop(Arena *arena, int order)
 {
-	if (index > (int)sizeof(buddy_bitmap))
+	FreeBlock *node = arena->free_lists[order];
+	if (node != NULL)
 	{
-		return;
+		free_list_remove(arena, order, node);
 	}
-	set_bitmap(index, value);
-	set_children(index * 2 + 1, value);
-	set_children(index * 2 + 2, value);
+	return node;
 }
 
 #ifdef DEBUG
 void print_bitmap()
 {
-	for (int i = 0; i < (int)sizeof(buddy_bitmap); i++)
+	for (size_t word = 0; word < bitmap_words; word++)
 	{
-		printf("%d", get_bitmap(i));
+		uint64_t bits = arenas[0].bitmap[word];
+		int count = word == bitmap_words - 1 ? (int)(total_nodes + 1 - word * 64) : 64;
+		for (int bit = word == 0 ? 1 : 0; bit < count; bit++)
+		{
+			putchar('0' + (int)((bits >> bit) & 1));
+		}
 	}
 	printf("\n");
 }
 #endif
 
-/* MALLOC FUNCTIONS*/
+/*STATISTICS*/
 
-// Large allocation function
-void *large_alloc(size_t size)
+// Helper function to get the bytes of a block of the given size class
+static inline size_t class_size(int size_class)
 {
-	// Calculate the total size including space to store the allocation size
-	size_t total_size = size + sizeof(size_t);
-	void *ptr = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (ptr == MAP_FAILED)
+	return size_class < SLAB_CLASSES ? (size_t)1 << (SLAB_MIN_SHIFT + size_class) : min_block_size << (size_class - SLAB_CLASSES);
+}
+
+// Helper function to add to a counter of the calling thread. The thread is its only writer,
+// the atomic store only keeps readers from seeing a torn value and compiles to a plain add.
+// Under an arena lock the counters are written without stats_thread, registering could allocate.
+static inline void stats_add(size_t *counter, size_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+// Helper function to add the counters of a thread to a total, the stats lock must be held
+static void stats_merge(ThreadStats *total, ThreadStats *stats)
+{
+	for (int size_class = 0; size_class < STATS_CLASSES; size_class++)
 	{
-		errno = EINVAL;
-		return NULL;
+		total->allocs[size_class] += __atomic_load_n(&stats->allocs[size_class], __ATOMIC_RELAXED);
+		total->frees[size_class] += __atomic_load_n(&stats->frees[size_class], __ATOMIC_RELAXED);
 	}
-	// Store the total size at the beginning of the allocated block
-	*((size_t *)ptr) = total_size;
-	// Return a pointer to the usable memory (after the size)
-	return (char *)ptr + sizeof(size_t);
+	total->large_allocs += __atomic_load_n(&stats->large_allocs, __ATOMIC_RELAXED);
+	total->large_frees += __atomic_load_n(&stats->large_frees, __ATOMIC_RELAXED);
+	total->large_granted_bytes += __atomic_load_n(&stats->large_granted_bytes, __ATOMIC_RELAXED);
+	total->large_freed_bytes += __atomic_load_n(&stats->large_freed_bytes, __ATOMIC_RELAXED);
+	total->splits += __atomic_load_n(&stats->splits, __ATOMIC_RELAXED);
+	total->coalesces += __atomic_load_n(&stats->coalesces, __ATOMIC_RELAXED);
+	total->requested_bytes += __atomic_load_n(&stats->requested_bytes, __ATOMIC_RELAXED);
 }
 
-// Buddy allocator function
-void *buddy_alloc(size_t size)
+// Helper function to move the counters of a thread to stats_retired and unlink them, the stats lock must be held
+static void stats_retire(ThreadStats *stats)
 {
-	int index = get_buddy_index(size);
-	int free_index = find_free_buddy(index);
-
-	if (free_index == -1)
+	stats_merge(&stats_retired, stats);
+	__atomic_add_fetch(&stats_in_use, stats->pending_bytes, __ATOMIC_RELAXED);
+	if (stats->prev != NULL)
 	{
-		// Fall back on large allocation if no free block is found
-		return large_alloc(size);
+		stats->prev->next = stats->next;
+	}
+	else
+	{
+		stats_threads = stats->next;
+	}
+	if (stats->next != NULL)
+	{
+		stats->next->prev = stats->prev;
 	}
+	memset(stats, 0, sizeof(*stats));
+}
 
+// Helper function to retire the counters of an exiting thread
+static void stats_release(void *arg)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats_retire(arg);
+	pthread_mutex_unlock(&stats_lock);
+}
 
-	set_bitmap(free_index, 1); // Mark the block as allocated
-	// Set children as allocated
-	set_children(free_index, 1);
+static void stats_create_key()
+{
+	pthread_key_create(&stats_key, stats_release);
+}
 
+// Helper function to make the counters of the calling thread visible to the readers
+static void stats_register(ThreadStats *stats)
+{
+	// Marked first: pthread_setspecific may allocate, and that allocation must not register the counters again
+	stats->registered = true;
+	pthread_mutex_lock(&stats_lock);
+	stats->prev = NULL;
+	stats->next = stats_threads;
+	if (stats_threads != NULL)
+	{
+		stats_threads->prev = stats;
+	}
+	stats_threads = stats;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_once(&stats_once, stats_create_key);
+	pthread_setspecific(stats_key, stats);
+}
 
-	// Propagate the allocation up to the parent blocks
-	int parent_index = free_index / 2;
-	while (parent_index > 0)
+// Helper function to get the counters of the calling thread
+static inline ThreadStats *stats_thread()
+{
+	ThreadStats *stats = &thread_stats;
+	if (__builtin_expect(!stats->registered, 0))
 	{
-		set_bitmap(parent_index, 1);
-		parent_index /= 2;
+		stats_register(stats);
 	}
+	return stats;
+}
 
-	return buddy_memory + free_index * MIN_BLOCK_SIZE;
+// Helper function to account bytes granted or freed by the calling thread. They reach the shared usage
+// in steps of STATS_FLUSH_BYTES, so the peak is exact to within that much per thread.
+static inline void stats_usage(ThreadStats *stats, long bytes)
+{
+	stats->pending_bytes += bytes;
+	if (__builtin_expect(stats->pending_bytes >= STATS_FLUSH_BYTES || stats->pending_bytes <= -STATS_FLUSH_BYTES, 0))
+	{
+		long in_use = __atomic_add_fetch(&stats_in_use, stats->pending_bytes, __ATOMIC_RELAXED);
+		stats->pending_bytes = 0;
+		size_t peak = __atomic_load_n(&stats_peak, __ATOMIC_RELAXED);
+		while (in_use > 0 && (size_t)in_use > peak && !__atomic_compare_exchange_n(&stats_peak, &peak, (size_t)in_use, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+		}
+	}
 }
 
-// Custom malloc function
-void *pseudo_malloc(size_t size)
+// Helper function to count count blocks of the given size class handed out for requests of size bytes
+static inline void stats_alloc(int size_class, size_t size, size_t count)
 {
-	if (size <= 0)
+	ThreadStats *stats = stats_thread();
+	stats_add(&stats->allocs[size_class], count);
+	stats_add(&stats->requested_bytes, size * count);
+	stats_usage(stats, (long)(class_size(size_class) * count));
+}
+
+// Helper function to count count blocks of the given size class given back
+static inline void stats_free(int size_class, size_t count)
+{
+	ThreadStats *stats = stats_thread();
+	stats_add(&stats->frees[size_class], count);
+	stats_usage(stats, -(long)(class_size(size_class) * count));
+}
+
+// Helper function to count a large mapping of length bytes handed out for a request of size bytes
+static void stats_large_alloc(size_t size, size_t length)
+{
+	ThreadStats *stats = stats_thread();
+	stats_add(&stats->large_allocs, 1);
+	stats_add(&stats->large_granted_bytes, length);
+	stats_add(&stats->requested_bytes, size);
+	stats_usage(stats, (long)length);
+}
+
+// Helper function to count a large mapping of length bytes given back
+static void stats_large_free(size_t length)
+{
+	ThreadStats *stats = stats_thread();
+	stats_add(&stats->large_frees, 1);
+	stats_add(&stats->large_freed_bytes, length);
+	stats_usage(stats, -(long)length);
+}
+
+// Helper function to zero every counter, when the memory they describe goes away with destroy_buddy_allocator
+static void stats_reset()
+{
+	pthread_mutex_lock(&stats_lock);
+	for (ThreadStats *stats = stats_threads; stats != NULL; stats = stats->next)
 	{
-		errno = EINVAL;
-		return NULL;
+		memset(stats->allocs, 0, sizeof(stats->allocs));
+		memset(stats->frees, 0, sizeof(stats->frees));
+		stats->large_allocs = stats->large_frees = stats->large_granted_bytes = stats->large_freed_bytes = 0;
+		stats->splits = stats->coalesces = stats->requested_bytes = 0;
+		stats->pending_bytes = 0;
 	}
-	else if (size < PAGE_SIZE / 4)
+	memset(&stats_retired, 0, sizeof(stats_retired));
+	__atomic_store_n(&purged_bytes, 0, __ATOMIC_RELAXED);
+	stats_in_use = 0;
+	stats_peak = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+// Get the allocator counters, added up over every thread since the allocator was initialized
+void pseudo_malloc_stats(MallocStats *stats)
+{
+	ThreadStats total;
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(&total, &stats_retired);
+	for (ThreadStats *thread = stats_threads; thread != NULL; thread = thread->next)
 	{
-		return buddy_alloc(size);
+		stats_merge(&total, thread);
 	}
-	else
+	pthread_mutex_unlock(&stats_lock);
+
+	memset(stats, 0, sizeof(*stats));
+	size_t freed_bytes = total.large_freed_bytes;
+	stats->granted_bytes = total.large_granted_bytes;
+	for (int size_class = 0; size_class < SLAB_CLASSES; size_class++)
 	{
-		return large_alloc(size);
+		stats->slab_allocs[size_class] = total.allocs[size_class];
+		stats->slab_frees[size_class] = total.frees[size_class];
 	}
-}
+	for (int order = 0; order < MAX_LEVELS; order++)
+	{
+		stats->buddy_allocs[order] = total.allocs[SLAB_CLASSES + order];
+		stats->buddy_frees[order] = total.frees[SLAB_CLASSES + order];
+	}
+	for (int size_class = 0; size_class < STATS_CLASSES; size_class++)
+	{
+		stats->arena_allocs += total.allocs[size_class];
+		stats->arena_frees += total.frees[size_class];
+		stats->granted_bytes += total.allocs[size_class] * class_size(size_class);
+		freed_bytes += total.frees[size_class] * class_size(size_class);
+	}
+	stats->large_allocs = total.large_allocs;
+	stats->large_frees = total.large_frees;
+	stats->splits = total.splits;
+	stats->coalesces = total.coalesces;
+	stats->requested_bytes = total.requested_bytes;
+	// A block freed by another thread than the one that allocated it may be counted before its allocation
+	stats->bytes_in_use = stats->granted_bytes > freed_bytes ? stats->granted_bytes - freed_bytes : 0;
+	size_t peak = __atomic_load_n(&stats_peak, __ATOMIC_RELAXED);
+	stats->peak_bytes_in_use = peak > stats->bytes_in_use ? peak : stats->bytes_in_use;
+	stats->fragmentation = stats->granted_bytes > 0 ? 1.0 - (double)stats->requested_bytes / (double)stats->granted_bytes : 0.0;
 
-/*FREE FUNCTION*/
+	// Mapped memory: the committed part of the arenas, their bitmaps, and the large mappings in use or cached
+	int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; i++)
+	{
+		stats->bytes_mapped += __atomic_load_n(&arenas[i].committed, __ATOMIC_RELAXED);
+	}
+	stats->bytes_mapped += (size_t)count * (bitmap_words + slab_map_words) * sizeof(uint64_t);
+	pthread_mutex_lock(&large_map_lock);
+	stats->bytes_mapped += large_map_bytes;
+	pthread_mutex_unlock(&large_map_lock);
+	LargeCacheStats cache;
+	pseudo_large_cache_stats(&cache);
+	stats->bytes_mapped += cache.cached_bytes;
+	stats->purged_bytes = __atomic_load_n(&purged_bytes, __ATOMIC_RELAXED);
+}
 
-// Large free function
-int large_free(void *ptr)
+// Helper function to append to a buffer like snprintf does, length counts the characters even past the end
+static void json_append(char *buffer, size_t size, size_t *length, const char *format, ...)
 {
-	if (ptr == NULL)
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(*length < size ? buffer + *length : NULL, *length < size ? size - *length : 0, format, args);
+	va_end(args);
+	if (written > 0)
 	{
-		errno = EINVAL;
-		return -1;
+		*length += (size_t)written;
 	}
-	// Get the original pointer by subtracting the size of size_t
-	void *real_ptr = (char *)ptr - sizeof(size_t);
-	// Retrieve the total size stored at the beginning of the block
-	size_t size = *((size_t *)real_ptr);
-	if (munmap(real_ptr, size) == -1)
+}
+
+// Helper function to append a JSON array of counters
+static void json_append_array(char *buffer, size_t size, size_t *length, const char *name, const size_t *values, int count)
+{
+	json_append(buffer, size, length, "\"%s\": [", name);
+	for (int i = 0; i < count; i++)
 	{
-		errno = EINVAL;
-		return -1;
+		json_append(buffer, size, length, i == 0 ? "%zu" : ", %zu", values[i]);
 	}
-	return 1;
+	json_append(buffer, size, length, "], ");
 }
 
-// Buddy free function
-int buddy_free(void *ptr)
+// Write the allocator counters as a JSON object. Like snprintf, the result is the length of the whole object,
+// and it was cut if that is not below size.
+size_t pseudo_malloc_stats_json(char *buffer, size_t size)
 {
-	int index = (ptr - buddy_memory) / MIN_BLOCK_SIZE;
-
-	if (get_bitmap(index) == 0)
+	MallocStats stats;
+	pseudo_malloc_stats(&stats);
+	size_t length = 0;
+	if (size > 0)
 	{
-		errno = EINVAL;
-		return -1;
+		buffer[0] = '\0';
 	}
+	json_append(buffer, size, &length, "{\"min_block_size\": %zu, ", min_block_size);
+	json_append_array(buffer, size, &length, "slab_allocs", stats.slab_allocs, STATS_SLAB_CLASSES);
+	json_append_array(buffer, size, &length, "slab_frees", stats.slab_frees, STATS_SLAB_CLASSES);
+	// Orders above the one of a whole arena are never used
+	json_append_array(buffer, size, &length, "buddy_allocs", stats.buddy_allocs, max_order + 1);
+	json_append_array(buffer, size, &length, "buddy_frees", stats.buddy_frees, max_order + 1);
+	json_append(buffer, size, &length,
+				"\"arena_allocs\": %zu, \"arena_frees\": %zu, \"large_allocs\": %zu, \"large_frees\": %zu, "
+				"\"splits\": %zu, \"coalesces\": %zu, \"requested_bytes\": %zu, \"granted_bytes\": %zu, "
+				"\"bytes_in_use\": %zu, \"bytes_mapped\": %zu, \"peak_bytes_in_use\": %zu, \"purged_bytes\": %zu, "
+				"\"fragmentation\": %.6f}",
+				stats.arena_allocs, stats.arena_frees, stats.large_allocs, stats.large_frees, stats.splits, stats.coalesces,
+				stats.requested_bytes, stats.granted_bytes, stats.bytes_in_use, stats.bytes_mapped, stats.peak_bytes_in_use,
+				stats.purged_bytes, stats.fragmentation);
+	return length;
+}
 
-	set_bitmap(index, 0); // Mark the block as free
-	set_children(index, 0);
+/*TRACING*/
 
-	// Coalesce free blocks
-	int buddy_index, parent_index;
-	while (index > 0)
-	{
-		buddy_index = index % 2 == 0 ? index + 1 : index - 1;
+// Helper function to get the clock of the trace records in nanoseconds
+static uint64_t trace_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 
-		// If the buddy block is also free
-		if (get_bitmap(buddy_index) == 0)
+// Helper function to write a whole buffer to a file, returns false on error
+static bool write_all(int fd, const void *data, size_t length)
+{
+	const char *bytes = data;
+	while (length > 0)
+	{
+		ssize_t written = write(fd, bytes, length);
+		if (written < 0 && errno == EINTR)
 		{
-			parent_index = index / 2;
-			set_bitmap(parent_index, 0); // Mark parent as free
-			index = parent_index;
+			continue;
 		}
-		else
+		if (written <= 0)
 		{
-			break;
+			return false;
 		}
+		bytes += written;
+		length -= (size_t)written;
 	}
-
-	return 0;
+	return true;
 }
 
-// Custom free function
-int pseudo_free(void *ptr)
+// Helper function to write out the records of a ring, its flush_lock must be held. Without a trace file they are dropped.
+static void trace_ring_write(TraceRing *ring)
 {
-	int ret = 1;
-	if (ptr == NULL)
-	{
-		return -1;
-	}
-	if (ptr >= buddy_memory && ptr <= (buddy_memory + BUDDY_MEMORY_SIZE))
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t tail = ring->tail;
+	while (trace_fd >= 0 && tail < head)
 	{
-		if (buddy_free(ptr) == -1)
+		// The records up to the end of the array, then the ones that wrapped around
+		size_t first = tail % TRACE_RING_RECORDS;
+		size_t count = head - tail < TRACE_RING_RECORDS - first ? head - tail : TRACE_RING_RECORDS - first;
+		if (!write_all(trace_fd, &ring->records[first], count * sizeof(TraceRecord)))
 		{
-			ret = -1;
+			break;
 		}
+		tail += count;
 	}
-	else
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+// Helper function to write out the records of a ring
+static void trace_ring_flush(TraceRing *ring)
+{
+	pthread_mutex_lock(&ring->flush_lock);
+	trace_ring_write(ring);
+	pthread_mutex_unlock(&ring->flush_lock);
+}
+
+// Helper function to write out and unmap the ring of an exiting thread
+static void trace_ring_release(void *arg)
+{
+	TraceRing *ring = arg;
+	pthread_mutex_lock(&trace_lock);
+	for (TraceRing **link = &trace_rings; *link != NULL; link = &(*link)->next)
 	{
-		if (large_free(ptr) == -1)
+		if (*link == ring)
 		{
-			ret = -1;
+			*link = ring->next;
+			break;
 		}
 	}
-	return ret;
+	trace_ring_flush(ring);
+	pthread_mutex_unlock(&trace_lock);
+	thread_trace_ring = NULL;
+	pthread_mutex_destroy(&ring->flush_lock);
+	munmap(ring, sizeof(TraceRing));
 }
 
-/*BUDDY_MEMORY*/
+static void trace_create_key()
+{
+	pthread_key_create(&trace_key, trace_ring_release);
+}
 
-// Constructor function to initialize buddy allocator
-int init_buddy_allocator()
+// Helper function to give the calling thread a ring, mapped directly so tracing never allocates
+static TraceRing *trace_ring_create()
 {
-	buddy_memory = mmap(NULL, BUDDY_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (buddy_memory == MAP_FAILED)
+	TraceRing *ring = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
 	{
-		return (-1);
+		return NULL;
 	}
-	memset(buddy_bitmap, 0, sizeof(buddy_bitmap));
-	return 0;
+	pthread_mutex_init(&ring->flush_lock, NULL);
+	// Set first: pthread_setspecific may allocate, and the call tracing that allocation must find the ring
+	thread_trace_ring = ring;
+	pthread_mutex_lock(&trace_lock);
+	ring->next = trace_rings;
+	trace_rings = ring;
+	pthread_mutex_unlock(&trace_lock);
+	pthread_once(&trace_once, trace_create_key);
+	pthread_setspecific(trace_key, ring);
+	return ring;
 }
 
-// Destructor function to destroy buddy allocator
-int destroy_buddy_allocator()
+// Helper function to append a record to the ring of the calling thread, writing the ring out when it is full
+static void trace_record(int op, const void *ptr, uint64_t aux, size_t size)
 {
-	// Unmap the buddy memory
-	if (munmap(buddy_memory, BUDDY_MEMORY_SIZE) == -1)
+	// Failed allocations are not traced
+	if (ptr == NULL && (op != TRACE_REALLOC || aux == 0))
 	{
-		return (-1);
+		return;
 	}
-	// Clear the buddy_bitmap array
-	memset(buddy_bitmap, 0, sizeof(buddy_bitmap));
-	return 0;
+	TraceRing *ring = thread_trace_ring;
+	if (ring == NULL && (ring = trace_ring_create()) == NULL)
+	{
+		return;
+	}
+	size_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_RECORDS)
+	{
+		trace_ring_flush(ring);
+	}
+	TraceRecord *record = &ring->records[head % TRACE_RING_RECORDS];
+	record->time = trace_clock() - trace_start;
+	record->ptr = (uintptr_t)ptr;
+	record->aux = aux;
+	record->info = TRACE_INFO(size, op);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Helper function to trace a call, all it costs while tracing is off is the check of trace_enabled
+static inline void trace_call(int op, const void *ptr, uint64_t aux, size_t size)
+{
+	if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0))
+	{
+		trace_record(op, ptr, aux, size);
+	}
+}
+
+// Start recording every allocation and free to the trace file at path, returns -1 if a trace is already recorded
+int pseudo_trace_start(const char *path)
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0)
+	{
+		pthread_mutex_unlock(&trace_lock);
+		errno = EBUSY;
+		return (-1);
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	TraceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(TraceRecord);
+	if (fd < 0 || !write_all(fd, &header, sizeof(header)))
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		pthread_mutex_unlock(&trace_lock);
+		return (-1);
+	}
+	// Records appended while the last trace was being stopped belong to no trace
+	for (TraceRing *ring = trace_rings; ring != NULL; ring = ring->next)
+	{
+		pthread_mutex_lock(&ring->flush_lock);
+		__atomic_store_n(&ring->tail, ring->head, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&ring->flush_lock);
+	}
+	trace_start = trace_clock();
+	trace_fd = fd;
+	__atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+// Stop recording the trace and write out the records every thread still buffers.
+// Calls running at the same time may be left out of the trace.
+int pseudo_trace_stop()
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd < 0)
+	{
+		pthread_mutex_unlock(&trace_lock);
+		errno = EINVAL;
+		return (-1);
+	}
+	__atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+	// Every ring stays locked until the file is forgotten, so no thread writes to it once it is closed
+	for (TraceRing *ring = trace_rings; ring != NULL; ring = ring->next)
+	{
+		pthread_mutex_lock(&ring->flush_lock);
+		trace_ring_write(ring);
+	}
+	int fd = trace_fd;
+	trace_fd = -1;
+	for (TraceRing *ring = trace_rings; ring != NULL; ring = ring->next)
+	{
+		pthread_mutex_unlock(&ring->flush_lock);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return close(fd) == 0 ? 0 : (-1);
+}
+
+/*MAPPINGS*/
+
+// Helper function to map length bytes aligned to alignment, trimming the excess of an oversized mapping
+static void *map_aligned(size_t length, size_t alignment, int prot, int flags)
+{
+	// The slack for the alignment must not wrap the length around
+	if (length == 0 || length > SIZE_MAX - alignment)
+	{
+		return MAP_FAILED;
+	}
+	char *ptr = mmap(NULL, length + alignment, prot, flags, -1, 0);
+	if (ptr == MAP_FAILED)
+	{
+		return MAP_FAILED;
+	}
+	size_t head = -(uintptr_t)ptr & (alignment - 1);
+	if (head > 0)
+	{
+		munmap(ptr, head);
+	}
+	munmap(ptr + head + length, alignment - head);
+	return ptr + head;
+}
+
+// Helper function to map length bytes backed by huge pages, at addr when it is not NULL (a reserved range).
+// Hugetlb pages are tried first, they only exist when the administrator reserved some and only cover whole
+// huge pages. Without them the mapping gets normal pages that the kernel may promote to transparent huge pages.
+static void *map_huge(void *addr, size_t length)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void *ptr = MAP_FAILED;
+	if (((uintptr_t)addr | length) % HUGE_PAGE_SIZE == 0)
+	{
+		ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+	}
+	if (ptr != MAP_FAILED && addr != NULL)
+	{
+		// A MAP_FIXED mmap over the reserved range unmaps it before it fails for want of huge pages, and the hole
+		// can be taken by another mapping. The huge pages are mapped elsewhere and moved in place once they exist.
+		void *moved = mremap(ptr, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, addr);
+		if (moved == MAP_FAILED)
+		{
+			munmap(ptr, length);
+		}
+		ptr = moved;
+	}
+	if (ptr != MAP_FAILED)
+	{
+		return ptr;
+	}
+	if (addr == NULL)
+	{
+		ptr = map_aligned(length, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, flags);
+	}
+	else
+	{
+		ptr = mprotect(addr, length, PROT_READ | PROT_WRITE) == -1 ? MAP_FAILED : addr;
+	}
+	if (ptr != MAP_FAILED)
+	{
+		// Only a hint, the mapping works the same when transparent huge pages are disabled
+		madvise(ptr, length, MADV_HUGEPAGE);
+	}
+	return ptr;
+}
+
+// Helper function to back a part of the reserved range with memory, with huge pages when they are enabled
+static bool commit_memory(void *start, size_t length)
+{
+	if (use_huge_pages)
+	{
+		return map_huge(start, length) != MAP_FAILED;
+	}
+	return mprotect(start, length, PROT_READ | PROT_WRITE) == 0;
+}
+
+// Back the memory committed from now on and large allocations of at least 2 MB with huge pages, or stop doing so
+void pseudo_set_huge_pages(bool enabled)
+{
+	use_huge_pages = enabled;
+}
+
+// Helper function to give pages back to the kernel while keeping them mapped. Lazily lets the kernel take them
+// only under memory pressure, otherwise they leave the resident memory right away.
+static void decommit_memory(void *start, size_t length, bool lazily)
+{
+#ifdef MADV_FREE
+	// MADV_FREE lets the kernel reclaim the pages lazily, older kernels only know MADV_DONTNEED
+	if (lazily && madvise(start, length, MADV_FREE) == 0)
+	{
+		return;
+	}
+#endif
+	madvise(start, length, MADV_DONTNEED);
+}
+
+/*LARGE CACHE*/
+
+// Helper function to give the pages of a cached mapping back to the kernel while keeping the mapping
+static void large_cache_decommit(LargeCacheEntry *entry, bool lazily)
+{
+	decommit_memory(entry->mapping, entry->length, lazily);
+	entry->resident = false;
+	large_cache_resident -= entry->length;
+}
+
+// Helper function to find the oldest cached entry, only the resident ones if resident_only, -1 if there is none
+static int large_cache_oldest(bool resident_only)
+{
+	int oldest = -1;
+	for (int bin = 1; bin <= LARGE_CACHE_BINS; bin++)
+	{
+		for (int slot = large_cache_bins[bin] - 1; slot >= 0; slot = large_cache[slot].next - 1)
+		{
+			if ((!resident_only || large_cache[slot].resident) && (oldest == -1 || large_cache[slot].stamp < large_cache[oldest].stamp))
+			{
+				oldest = slot;
+			}
+		}
+	}
+	return oldest;
+}
+
+// Helper function to unlink an entry from its bin and put its slot back on the unused list, large_cache_lock must be held
+static void large_cache_remove(int slot)
+{
+	LargeCacheEntry *entry = &large_cache[slot];
+	int *link = &large_cache_bins[entry->length / PAGE_SIZE];
+	while (*link != slot + 1)
+	{
+		link = &large_cache[*link - 1].next;
+	}
+	*link = entry->next;
+	if (entry->resident)
+	{
+		large_cache_resident -= entry->length;
+	}
+	entry->mapping = NULL;
+	entry->next = large_cache_unused;
+	large_cache_unused = slot + 1;
+}
+
+// Helper function to take a cached mapping of the given length, NULL if there is none
+static void *large_cache_take(size_t length)
+{
+	size_t pages = length / PAGE_SIZE;
+	if (pages > LARGE_CACHE_BINS)
+	{
+		return NULL;
+	}
+	void *mapping = NULL;
+	pthread_mutex_lock(&large_cache_lock);
+	int slot = large_cache_bins[pages] - 1;
+	if (slot >= 0)
+	{
+		// Bins are LIFO, so the most recently freed and most likely resident mapping is reused first
+		mapping = large_cache[slot].mapping;
+		large_cache_remove(slot);
+		large_cache_hits++;
+	}
+	else
+	{
+		large_cache_misses++;
+	}
+	pthread_mutex_unlock(&large_cache_lock);
+	return mapping;
+}
+
+// Helper function to keep a freed mapping for reuse, returns false if it has to be unmapped instead
+static bool large_cache_put(void *mapping, size_t length)
+{
+	size_t pages = length / PAGE_SIZE;
+	if (pages > LARGE_CACHE_BINS)
+	{
+		return false;
+	}
+	LargeCacheEntry evicted = {0};
+	pthread_mutex_lock(&large_cache_lock);
+	if (large_cache_unused == 0)
+	{
+		// Every slot is taken, make room by dropping the oldest mapping
+		int oldest = large_cache_oldest(false);
+		evicted = large_cache[oldest];
+		large_cache_remove(oldest);
+	}
+	int slot = large_cache_unused - 1;
+	LargeCacheEntry *entry = &large_cache[slot];
+	large_cache_unused = entry->next;
+	entry->mapping = mapping;
+	entry->length = length;
+	entry->stamp = ++large_cache_stamp;
+	entry->resident = true;
+	entry->next = large_cache_bins[pages];
+	large_cache_bins[pages] = slot + 1;
+	large_cache_resident += length;
+	// Over budget, the oldest mappings lose their pages but stay mapped for reuse
+	while (large_cache_resident > large_cache_budget)
+	{
+		large_cache_decommit(&large_cache[large_cache_oldest(true)], true);
+	}
+	pthread_mutex_unlock(&large_cache_lock);
+	if (evicted.mapping != NULL)
+	{
+		munmap(evicted.mapping, evicted.length);
+	}
+	return true;
+}
+
+// Helper function to unmap every cached mapping and reset the cache
+static void large_cache_clear()
+{
+	pthread_mutex_lock(&large_cache_lock);
+	for (int slot = 0; slot < LARGE_CACHE_SLOTS; slot++)
+	{
+		if (large_cache[slot].mapping != NULL)
+		{
+			munmap(large_cache[slot].mapping, large_cache[slot].length);
+		}
+		large_cache[slot].mapping = NULL;
+		large_cache[slot].next = slot + 2 <= LARGE_CACHE_SLOTS ? slot + 2 : 0;
+	}
+	memset(large_cache_bins, 0, sizeof(large_cache_bins));
+	large_cache_unused = 1;
+	large_cache_resident = 0;
+	pthread_mutex_unlock(&large_cache_lock);
+}
+
+// Set how many bytes of cached large mappings may stay resident, the oldest ones beyond it are decommitted
+void pseudo_set_large_cache_budget(size_t bytes)
+{
+	pthread_mutex_lock(&large_cache_lock);
+	large_cache_budget = bytes;
+	while (large_cache_resident > large_cache_budget)
+	{
+		large_cache_decommit(&large_cache[large_cache_oldest(true)], true);
+	}
+	pthread_mutex_unlock(&large_cache_lock);
+}
+
+// Get the hit and miss counts and the size of the large mapping cache
+void pseudo_large_cache_stats(LargeCacheStats *stats)
+{
+	pthread_mutex_lock(&large_cache_lock);
+	stats->hits = large_cache_hits;
+	stats->misses = large_cache_misses;
+	stats->cached_bytes = 0;
+	for (int slot = 0; slot < LARGE_CACHE_SLOTS; slot++)
+	{
+		if (large_cache[slot].mapping != NULL)
+		{
+			stats->cached_bytes += large_cache[slot].length;
+		}
+	}
+	stats->resident_bytes = large_cache_resident;
+	pthread_mutex_unlock(&large_cache_lock);
+}
+
+/*LARGE MAP*/
+
+// Helper function to get the home slot of a mapping in the large map
+static size_t large_map_hash(uintptr_t mapping)
+{
+	// Mappings are page aligned, the page number is spread over the table with a multiplicative hash
+	return (size_t)((mapping / PAGE_SIZE) * (uintptr_t)0x9E3779B97F4A7C15ULL) & (large_map_slots - 1);
+}
+
+// Helper function to get the slot holding a mapping, or the empty slot it would go in, large_map_lock must be held
+static size_t large_map_slot(uintptr_t mapping)
+{
+	size_t slot = large_map_hash(mapping);
+	while (large_map[slot].mapping != 0 && large_map[slot].mapping != mapping)
+	{
+		slot = (slot + 1) & (large_map_slots - 1);
+	}
+	return slot;
+}
+
+// Helper function to double the slots of the large map, large_map_lock must be held
+static bool large_map_grow()
+{
+	size_t slots = large_map_slots > 0 ? large_map_slots * 2 : LARGE_MAP_MIN_SLOTS;
+	// The table cannot come from pseudo_malloc, large allocations are what it keeps track of
+	LargeMapEntry *table = mmap(NULL, slots * sizeof(LargeMapEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED)
+	{
+		return false;
+	}
+	LargeMapEntry *old_table = large_map;
+	size_t old_slots = large_map_slots;
+	large_map = table;
+	large_map_slots = slots;
+	for (size_t slot = 0; slot < old_slots; slot++)
+	{
+		if (old_table[slot].mapping != 0)
+		{
+			large_map[large_map_slot(old_table[slot].mapping)] = old_table[slot];
+		}
+	}
+	if (old_table != NULL)
+	{
+		munmap(old_table, old_slots * sizeof(LargeMapEntry));
+	}
+	return true;
+}
+
+// Helper function to record the length of a large mapping, returns false if the table cannot grow.
+// large_map_lock must be held.
+static bool large_map_put(void *mapping, size_t length)
+{
+	// Keep the table at most half full so probe chains stay short
+	if ((large_map_count + 1) * 2 > large_map_slots && !large_map_grow())
+	{
+		return false;
+	}
+	size_t slot = large_map_slot((uintptr_t)mapping);
+	large_map[slot].mapping = (uintptr_t)mapping;
+	large_map[slot].length = length;
+	large_map_count++;
+	large_map_bytes += length;
+	return true;
+}
+
+// Helper function to record the length of a large mapping, returns false if the table cannot grow
+static bool large_map_insert(void *mapping, size_t length)
+{
+	pthread_mutex_lock(&large_map_lock);
+	bool inserted = large_map_put(mapping, length);
+	pthread_mutex_unlock(&large_map_lock);
+	return inserted;
+}
+
+// Helper function to get the length of a large mapping, 0 if it is not one
+static size_t large_map_find(void *mapping)
+{
+	size_t length = 0;
+	pthread_mutex_lock(&large_map_lock);
+	if (large_map_slots > 0)
+	{
+		length = large_map[large_map_slot((uintptr_t)mapping)].length;
+	}
+	pthread_mutex_unlock(&large_map_lock);
+	return length;
+}
+
+// Helper function to forget a large mapping, returns its length or 0 if it is not one. large_map_lock must be held.
+// The following entries of the probe chain are shifted back, so the table never needs tombstones.
+static size_t large_map_delete(void *mapping)
+{
+	if (large_map_slots == 0 || large_map[large_map_slot((uintptr_t)mapping)].mapping == 0)
+	{
+		return 0;
+	}
+	size_t mask = large_map_slots - 1;
+	size_t hole = large_map_slot((uintptr_t)mapping);
+	size_t length = large_map[hole].length;
+	for (size_t next = (hole + 1) & mask; large_map[next].mapping != 0; next = (next + 1) & mask)
+	{
+		// An entry can fill the hole only if the hole is on the way from its home slot to where it is
+		size_t home = large_map_hash(large_map[next].mapping);
+		if (((next - home) & mask) >= ((next - hole) & mask))
+		{
+			large_map[hole] = large_map[next];
+			hole = next;
+		}
+	}
+	large_map[hole].mapping = 0;
+	large_map[hole].length = 0;
+	large_map_count--;
+	large_map_bytes -= length;
+	return length;
+}
+
+// Helper function to forget a large mapping, returns its length or 0 if it is not one
+static size_t large_map_remove(void *mapping)
+{
+	pthread_mutex_lock(&large_map_lock);
+	size_t length = large_map_delete(mapping);
+	pthread_mutex_unlock(&large_map_lock);
+	return length;
+}
+
+// Helper function to drop the large map
+static void large_map_clear()
+{
+	pthread_mutex_lock(&large_map_lock);
+	if (large_map != NULL)
+	{
+		munmap(large_map, large_map_slots * sizeof(LargeMapEntry));
+	}
+	large_map = NULL;
+	large_map_slots = 0;
+	large_map_count = 0;
+	large_map_bytes = 0;
+	pthread_mutex_unlock(&large_map_lock);
+}
+
+/* MALLOC FUNCTIONS*/
+
+// Helper function to get the length of a mapping holding the given size, 0 if it is too large for any mapping
+static size_t large_length(size_t size)
+{
+	// Sizes whose rounding would wrap around get 0, no mapping can hold them
+	if (size > SIZE_MAX - HUGE_PAGE_SIZE)
+	{
+		return 0;
+	}
+	// Round to whole pages
+	size_t total_size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+	if (use_huge_pages && total_size >= HUGE_PAGE_SIZE)
+	{
+		// Round up to whole huge pages, which also makes the length valid for a hugetlb mapping
+		total_size = (total_size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	}
+	return total_size;
+}
+
+// Large aligned allocation function. The mapping has no header, its length is recorded in the large map,
+// so the block keeps the alignment of the mapping and a request of whole pages takes exactly those pages.
+void *large_aligned_alloc(size_t size, size_t alignment)
+{
+	size_t length = large_length(size);
+	void *ptr;
+	if (length == 0)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (use_huge_pages && length >= HUGE_PAGE_SIZE && alignment <= HUGE_PAGE_SIZE)
+	{
+		ptr = map_huge(NULL, length);
+	}
+	else if (alignment > PAGE_SIZE)
+	{
+		ptr = map_aligned(length, alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+	}
+	else if ((ptr = large_cache_take(length)) == NULL)
+	{
+		ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (ptr == MAP_FAILED)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (!large_map_insert(ptr, length))
+	{
+		munmap(ptr, length);
+		errno = ENOMEM;
+		return NULL;
+	}
+	stats_large_alloc(size, length);
+	return ptr;
+}
+
+// Large allocation function
+void *large_alloc(size_t size)
+{
+	return large_aligned_alloc(size, PAGE_SIZE);
+}
+
+// Helper function to give the pages of the free blocks dirty since before cutoff back to the kernel, all but the first
+// page of each block that keeps its free list links. The arena lock must be held. Returns the bytes given back.
+// The blocks already stayed free for the decay time, so they leave the resident memory right away instead of lazily.
+static size_t arena_purge(Arena *arena, uint64_t cutoff)
+{
+	size_t purged = 0;
+	uint64_t oldest = 0;
+	for (int order = purge_order; order <= max_order; order++)
+	{
+		for (FreeBlock *block = arena->free_lists[order]; block != NULL; block = block->next)
+		{
+			if (block->dirty_since == 0)
+			{
+				continue;
+			}
+			if (block->dirty_since > cutoff)
+			{
+				oldest = oldest == 0 || block->dirty_since < oldest ? block->dirty_since : oldest;
+				continue;
+			}
+			size_t length = (min_block_size << order) - PAGE_SIZE;
+			decommit_memory((char *)block + PAGE_SIZE, length, false);
+			block->dirty_since = 0;
+			purged += length;
+		}
+	}
+	arena->purge_at = oldest == 0 ? 0 : oldest + decay_time;
+	__atomic_fetch_add(&purged_bytes, purged, __ATOMIC_RELAXED);
+	return purged;
+}
+
+// Helper function to merge a free block with its free buddies and put the result on its free list, the arena lock
+// must be held. The merged block is as dirty as the most recent of its parts. Returns the order of the merged block.
+static int buddy_merge_block(Arena *arena, size_t offset, int order, uint64_t dirty_since)
+{
+	size_t node = node_index(offset, order);
+	arena_set_bitmap(arena, node, 0); // Mark the block as free
+
+	// Coalesce free blocks, one bit read and one bit written per order on the way up
+	size_t coalesces = 0;
+	while (order < max_order)
+	{
+		// If the buddy block is also free it is on the free list of the same order
+		if (arena_get_bitmap(arena, node ^ 1))
+		{
+			break;
+		}
+		FreeBlock *buddy = (FreeBlock *)((char *)arena->memory + (offset ^ (min_block_size << order)));
+		dirty_since = buddy->dirty_since > dirty_since ? buddy->dirty_since : dirty_since;
+		free_list_remove(arena, order, buddy);
+		offset &= ~(min_block_size << order);
+		order++;
+		node >>= 1;
+		arena_set_bitmap(arena, node, 0); // Mark parent as free
+		coalesces++;
+	}
+	free_list_push(arena, order, (char *)arena->memory + offset, dirty_since);
+	if (coalesces > 0)
+	{
+		stats_add(&thread_stats.coalesces, coalesces);
+	}
+	return order;
+}
+
+// Helper function to give a block back to an arena, the arena lock must be held. Blocks of purge_order and above
+// are purged once they stayed free for the decay time, checked when blocks are freed so allocating never makes
+// a system call.
+static void buddy_free_block(Arena *arena, size_t offset, int order)
+{
+	// The block was in use so its pages are resident
+	uint64_t now = coarse_clock();
+	order = buddy_merge_block(arena, offset, order, now);
+	if (order >= purge_order && arena->purge_at == 0)
+	{
+		arena->purge_at = now + decay_time;
+	}
+	if (arena->purge_at != 0 && now >= arena->purge_at)
+	{
+		arena_purge(arena, now - decay_time);
+	}
+}
+
+// Helper function to commit the placeholder block above the committed part of an arena, which doubles that part.
+// The arena lock must be held.
+static bool arena_grow(Arena *arena)
+{
+	size_t offset = arena->committed;
+	if (offset == arena_size || !commit_memory((char *)arena->memory + offset, offset))
+	{
+		return false;
+	}
+	__atomic_store_n(&arena->committed, offset * 2, __ATOMIC_RELAXED);
+	// The placeholder is as large as the committed part, freeing it merges the two when that part is all free.
+	// Its pages were never touched, so it is not dirty.
+	buddy_merge_block(arena, offset, __builtin_ctzl(offset) - min_block_shift, 0);
+	return true;
+}
+
+// Helper function to take a block of the given order from an arena, the arena lock must be held
+static void *buddy_alloc_block(Arena *arena, int index)
+{
+	// Find the smallest order with a free block that can hold the request
+	unsigned int candidates = index <= max_order ? arena->free_order_mask >> index : 0;
+	// Commit more of the arena until it has a block large enough
+	while (candidates == 0 && index <= max_order && arena_grow(arena))
+	{
+		candidates = arena->free_order_mask >> index;
+	}
+	if (candidates == 0)
+	{
+		return NULL;
+	}
+	int order = index + __builtin_ctz(candidates);
+
+	void *block = free_list_pop(arena, order);
+	uint64_t dirty_since = ((FreeBlock *)block)->dirty_since;
+	size_t node = node_index(arena_offset(arena, block), order);
+	arena_set_bitmap(arena, node, 1); // Mark the block as allocated
+
+	// Split the block until it has the requested order, the upper halves go back on the free lists
+	if (order > index)
+	{
+		stats_add(&thread_stats.splits, (size_t)(order - index));
+	}
+	while (order > index)
+	{
+		order--;
+		// The upper half is as dirty as the block it was split from
+		free_list_push(arena, order, (char *)block + (min_block_size << order), dirty_since);
+		node *= 2; // The lower half keeps the request
+		arena_set_bitmap(arena, node, 1);
+	}
+
+	return block;
+}
+
+// Helper function to resize an allocated block of an arena to a new order without moving it, the arena lock must be held.
+// Growing merges the free buddies above the block, so it fails if one of them is not free. Shrinking always succeeds.
+static bool buddy_resize_block(Arena *arena, size_t offset, int order, int new_order)
+{
+	for (int level = order; level < new_order; level++)
+	{
+		// The block must be the lower half at every order it goes through, with a free upper half
+		size_t buddy_offset = offset + (min_block_size << level);
+		if ((offset & (min_block_size << level)) || arena_get_bitmap(arena, node_index(buddy_offset, level)))
+		{
+			return false;
+		}
+	}
+	// Growing merges one buddy per order, shrinking splits once per order
+	stats_add(new_order > order ? &thread_stats.coalesces : &thread_stats.splits, (size_t)(new_order > order ? new_order - order : order - new_order));
+	// The node of the larger order is already set because it was split
+	for (int level = order; level < new_order; level++)
+	{
+		free_list_remove(arena, level, (char *)arena->memory + offset + (min_block_size << level));
+		arena_set_bitmap(arena, node_index(offset, level), 0);
+	}
+	// Split the block like buddy_alloc_block does, the upper halves go back on the free lists
+	for (int level = order - 1; level >= new_order; level--)
+	{
+		arena_set_bitmap(arena, node_index(offset, level), 1);
+		free_list_push(arena, level, (char *)arena->memory + offset + (min_block_size << level), coarse_clock());
+	}
+	return true;
+}
+
+// Helper function to get the order of the allocated block at the given offset of an arena, -1 if there is none.
+// It does not need the arena lock: the bits it reads belong to the block itself and only change when it is freed.
+static int buddy_block_order(Arena *arena, size_t offset)
+{
+	// Blocks past the committed memory are the placeholders of the uncommitted part
+	if (offset % min_block_size != 0 || offset >= __atomic_load_n(&arena->committed, __ATOMIC_RELAXED))
+	{
+		return -1;
+	}
+	// The block starting at this offset is the lowest set node among the ones starting there. It is allocated if both
+	// its halves are clear, a split node means the lower half is a free block.
+	for (int order = 0; order <= max_order; order++)
+	{
+		size_t node = node_index(offset, order);
+		if (arena_get_bitmap(arena, node))
+		{
+			return order == 0 || arena_halves_free(arena, node) ? order : -1;
+		}
+		if (offset & (min_block_size << order))
+		{
+			// No larger block starts here, so the pointer is not allocated
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/*SLABS*/
+
+// Helper function to check if the block at the given offset of an arena is carved into slab objects
+static bool arena_is_slab(Arena *arena, size_t offset)
+{
+	size_t slab = offset / SLAB_SIZE;
+	return (__atomic_load_n(&arena->slab_map[slab / 64], __ATOMIC_RELAXED) >> (slab % 64)) & 1;
+}
+
+// Helper function to mark the block at the given offset of an arena as a slab or not, the arena lock must be held
+static void arena_mark_slab(Arena *arena, size_t offset, bool value)
+{
+	size_t slab = offset / SLAB_SIZE;
+	uint64_t mask = (uint64_t)1 << (slab % 64);
+	uint64_t word = value ? arena->slab_map[slab / 64] | mask : arena->slab_map[slab / 64] & ~mask;
+	__atomic_store_n(&arena->slab_map[slab / 64], word, __ATOMIC_RELAXED);
+}
+
+// Helper function to mark an object of a slab as allocated or free, the arena lock must be held
+static void slab_set_used(Slab *slab, size_t object, bool value)
+{
+	uint64_t mask = (uint64_t)1 << (object % 64);
+	uint64_t word = value ? slab->used[object / 64] | mask : slab->used[object / 64] & ~mask;
+	__atomic_store_n(&slab->used[object / 64], word, __ATOMIC_RELAXED);
+}
+
+// Helper function to push a slab on the partial list of its size class
+static void slab_list_push(Arena *arena, Slab *slab)
+{
+	Slab *head = arena->partial_slabs[slab->size_class];
+	slab->prev = NULL;
+	slab->next = head;
+	if (head != NULL)
+	{
+		head->prev = slab;
+	}
+	__atomic_store_n(&arena->partial_slabs[slab->size_class], slab, __ATOMIC_RELAXED);
+}
+
+// Helper function to unlink a slab from the partial list of its size class
+static void slab_list_remove(Arena *arena, Slab *slab)
+{
+	if (slab->prev != NULL)
+	{
+		slab->prev->next = slab->next;
+	}
+	else
+	{
+		__atomic_store_n(&arena->partial_slabs[slab->size_class], slab->next, __ATOMIC_RELAXED);
+	}
+	if (slab->next != NULL)
+	{
+		slab->next->prev = slab->prev;
+	}
+	slab->next = slab->prev = NULL;
+}
+
+// Helper function to carve a new slab of the given size class out of an arena, the arena lock must be held
+static Slab *slab_create(Arena *arena, int size_class)
+{
+	Slab *slab = buddy_alloc_block(arena, slab_order);
+	if (slab == NULL)
+	{
+		return NULL;
+	}
+	slab->size_class = size_class;
+	slab->object_count = (SLAB_SIZE - SLAB_HEADER_SIZE) >> (SLAB_MIN_SHIFT + size_class);
+	slab->free_count = slab->object_count;
+	memset(slab->used, 0, sizeof(slab->used));
+	arena_mark_slab(arena, arena_offset(arena, slab), true);
+	slab_list_push(arena, slab);
+	return slab;
+}
+
+// Helper function to take up to count objects of the given size class from the slabs of an arena, the arena lock must be held
+static int slab_take_objects(Arena *arena, int size_class, void **objects, int count)
+{
+	size_t size = (size_t)1 << (SLAB_MIN_SHIFT + size_class);
+	int taken = 0;
+	while (taken < count)
+	{
+		Slab *slab = arena->partial_slabs[size_class];
+		if (slab == NULL && (slab = slab_create(arena, size_class)) == NULL)
+		{
+			break;
+		}
+		// Every object before the last one found is allocated, so each search resumes after it
+		size_t object = 0;
+		while (taken < count && slab->free_count > 0)
+		{
+			object = (size_t)find_clear_bit(slab->used, (size_t)slab->object_count, object);
+			slab_set_used(slab, object, true);
+			slab->free_count--;
+			objects[taken++] = (char *)slab + SLAB_HEADER_SIZE + object * size;
+			object++;
+		}
+		if (slab->free_count == 0)
+		{
+			slab_list_remove(arena, slab);
+		}
+	}
+	return taken;
+}
+
+// Helper function to give an object back to its slab, the arena lock must be held.
+// An empty slab goes back to the buddy memory unless it is the last partial slab of its class.
+static void slab_free_object(Arena *arena, void *ptr)
+{
+	Slab *slab = (Slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+	size_t object = ((uintptr_t)ptr - (uintptr_t)slab - SLAB_HEADER_SIZE) >> (SLAB_MIN_SHIFT + slab->size_class);
+	if (!((slab->used[object / 64] >> (object % 64)) & 1))
+	{
+		// A double free across threads, the object is already free
+		return;
+	}
+	slab_set_used(slab, object, false);
+	slab->free_count++;
+	if (slab->free_count == 1)
+	{
+		// The slab was full, it has room again
+		slab_list_push(arena, slab);
+	}
+	if (slab->free_count == slab->object_count && (arena->partial_slabs[slab->size_class] != slab || slab->next != NULL))
+	{
+		size_t offset = arena_offset(arena, slab);
+		slab_list_remove(arena, slab);
+		arena_mark_slab(arena, offset, false);
+		buddy_free_block(arena, offset, slab_order);
+	}
+}
+
+// Helper function to give the empty slabs of an arena back to the buddy memory, the arena lock must be held
+static void slab_release_empty(Arena *arena)
+{
+	for (int size_class = 0; size_class < SLAB_CLASSES; size_class++)
+	{
+		Slab *slab = arena->partial_slabs[size_class];
+		while (slab != NULL)
+		{
+			Slab *next = slab->next;
+			if (slab->free_count == slab->object_count)
+			{
+				size_t offset = arena_offset(arena, slab);
+				slab_list_remove(arena, slab);
+				arena_mark_slab(arena, offset, false);
+				buddy_free_block(arena, offset, slab_order);
+			}
+			slab = next;
+		}
+	}
+}
+
+// Helper function to get the size class of an allocated slab object, -1 if the pointer is not one.
+// Like buddy_block_order it reads only state that cannot change while the object is allocated.
+static int slab_object_class(void *ptr)
+{
+	Slab *slab = (Slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+	size_t offset = (uintptr_t)ptr - (uintptr_t)slab;
+	if (offset < SLAB_HEADER_SIZE)
+	{
+		return -1;
+	}
+	int size_class = slab->size_class;
+	size_t object = (offset - SLAB_HEADER_SIZE) >> (SLAB_MIN_SHIFT + size_class);
+	if (((offset - SLAB_HEADER_SIZE) & (((size_t)1 << (SLAB_MIN_SHIFT + size_class)) - 1)) != 0 || object >= (size_t)slab->object_count)
+	{
+		return -1;
+	}
+	if (!((__atomic_load_n(&slab->used[object / 64], __ATOMIC_RELAXED) >> (object % 64)) & 1))
+	{
+		return -1;
+	}
+	return size_class;
+}
+
+// Helper function to give a block of the given size class back to its arena, the arena lock must be held
+static void arena_release_block(Arena *arena, int size_class, void *block)
+{
+	if (size_class < SLAB_CLASSES)
+	{
+		slab_free_object(arena, block);
+	}
+	else
+	{
+		buddy_free_block(arena, arena_offset(arena, block), size_class - SLAB_CLASSES);
+	}
+}
+
+/*ARENAS*/
+
+// Helper function to get the arena owning a pointer, NULL if the pointer is in no arena
+static Arena *arena_of(const void *ptr)
+{
+	// A pointer below arena_space wraps around to a huge offset
+	uintptr_t offset = (uintptr_t)ptr - (uintptr_t)arena_space;
+	int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+	if (offset >= (uintptr_t)count << arena_shift)
+	{
+		return NULL;
+	}
+	return &arenas[offset >> arena_shift];
+}
+
+// Helper function to commit the next arena of the reserved range, arenas_lock must be held
+static Arena *arena_create()
+{
+	if (arena_count == max_arenas)
+	{
+		return NULL;
+	}
+	Arena *arena = &arenas[arena_count];
+	char *memory = arena_space + ((size_t)arena_count << arena_shift);
+	// The bitmap and the slab map are sized with the geometry, they get a mapping of their own
+	size_t metadata_size = (bitmap_words + slab_map_words) * sizeof(uint64_t);
+	uint64_t *metadata = mmap(NULL, metadata_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (metadata == MAP_FAILED)
+	{
+		return NULL;
+	}
+	if (!commit_memory(memory, commit_size))
+	{
+		munmap(metadata, metadata_size);
+		return NULL;
+	}
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->memory = memory;
+	arena->committed = commit_size;
+	arena->free_order_mask = 0;
+	arena->purge_at = 0;
+	arena->remote_frees = NULL;
+	memset(arena->free_lists, 0, sizeof(arena->free_lists));
+	memset(arena->partial_slabs, 0, sizeof(arena->partial_slabs));
+	arena->bitmap = metadata;
+	arena->slab_map = metadata + bitmap_words;
+	// The committed part starts as a single free block. Every block on the way up to the whole arena is split,
+	// and its upper half is a placeholder that arena_grow commits when the arena runs out of room.
+	int order = __builtin_ctzl(commit_size) - min_block_shift;
+	free_list_push(arena, order, memory, 0);
+	for (; order < max_order; order++)
+	{
+		arena_set_bitmap(arena, node_index(0, order + 1), 1);
+		arena_set_bitmap(arena, node_index(min_block_size << order, order), 1);
+	}
+	// Publish the arena only once it is ready, arena_of reads arena_count without a lock
+	__atomic_store_n(&arena_count, arena_count + 1, __ATOMIC_RELEASE);
+	return arena;
+}
+
+// Helper function to get the cpu slot of the calling thread, threads are spread round robin when sched_getcpu fails
+static int current_cpu_slot()
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+	{
+		cpu = __atomic_fetch_add(&next_round_robin_slot, 1, __ATOMIC_RELAXED);
+	}
+	return cpu % MAX_CPUS;
+}
+
+// Helper function to get the arena of a cpu slot, giving the slot an arena of its own the first time
+static Arena *arena_for_cpu(int slot)
+{
+	pthread_mutex_lock(&arenas_lock);
+	Arena *arena = cpu_arena[slot] > 0 ? &arenas[cpu_arena[slot] - 1] : NULL;
+	if (arena == NULL)
+	{
+		// Every cpu gets an arena of its own as long as there is room for one, then they are shared
+		arena = assigned_arenas < arena_count ? &arenas[assigned_arenas] : arena_create();
+		if (arena != NULL)
+		{
+			assigned_arenas++;
+		}
+		else if (arena_count > 0)
+		{
+			arena = &arenas[slot % arena_count];
+		}
+		if (arena != NULL)
+		{
+			cpu_arena[slot] = (int)(arena - arenas) + 1;
+		}
+	}
+	pthread_mutex_unlock(&arenas_lock);
+	return arena;
+}
+
+// Helper function to publish a chain of blocks on the remote free list of their arena without taking its lock
+static void remote_free_push(Arena *arena, RemoteBlock *first, RemoteBlock *last)
+{
+	RemoteBlock *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+	do
+	{
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Helper function to give the blocks freed by other threads back to an arena, the arena lock must be held
+static void remote_free_drain(Arena *arena)
+{
+	if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+	{
+		return;
+	}
+	// Taking the whole list at once leaves nothing for a CAS to mistake, so there is no ABA problem
+	RemoteBlock *block = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+	while (block != NULL)
+	{
+		RemoteBlock *next = block->next;
+		size_t offset = arena_offset(arena, block);
+		// Slab objects may be too small to hold an order, their slab knows their class
+		if (arena_is_slab(arena, offset))
+		{
+			slab_free_object(arena, block);
+		}
+		// A double free across threads would show up here as a block that is no longer allocated
+		else if (buddy_block_order(arena, offset) == block->order)
+		{
+			buddy_free_block(arena, offset, block->order);
+		}
+		block = next;
+	}
+}
+
+// Helper function to take up to count blocks of the given size class from an arena
+static int arena_take_blocks(Arena *arena, int size_class, void **blocks, int count)
+{
+	int taken = 0;
+	pthread_mutex_lock(&arena->lock);
+	remote_free_drain(arena);
+	if (size_class < SLAB_CLASSES)
+	{
+		taken = slab_take_objects(arena, size_class, blocks, count);
+	}
+	while (size_class >= SLAB_CLASSES && taken < count && (blocks[taken] = buddy_alloc_block(arena, size_class - SLAB_CLASSES)) != NULL)
+	{
+		taken++;
+	}
+	pthread_mutex_unlock(&arena->lock);
+	return taken;
+}
+
+// Helper function to guess without the lock if an arena can serve a block of the given size class
+static bool arena_has_room(Arena *arena, int size_class)
+{
+	int order = size_class < SLAB_CLASSES ? slab_order : size_class - SLAB_CLASSES;
+	unsigned int mask = __atomic_load_n(&arena->free_order_mask, __ATOMIC_RELAXED);
+	if ((mask >> order) != 0 || __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) != NULL ||
+		__atomic_load_n(&arena->committed, __ATOMIC_RELAXED) < arena_size)
+	{
+		return true;
+	}
+	return size_class < SLAB_CLASSES && __atomic_load_n(&arena->partial_slabs[size_class], __ATOMIC_RELAXED) != NULL;
+}
+
+// Helper function to take up to count blocks of the given size class for the calling thread.
+// They come from the arena of the thread, or from the other arenas once it is exhausted.
+static int arena_alloc_blocks(int size_class, void **blocks, int count)
+{
+	if (size_class - SLAB_CLASSES > max_order)
+	{
+		return 0;
+	}
+	thread_cache_current();
+	Arena *home = thread_arena;
+	if (home == NULL)
+	{
+		home = thread_arena = arena_for_cpu(current_cpu_slot());
+		if (home == NULL)
+		{
+			return 0;
+		}
+	}
+	int taken = arena_take_blocks(home, size_class, blocks, count);
+	if (taken > 0)
+	{
+		return taken;
+	}
+
+	// Overflow into the arenas that still have room
+	int arenas_seen = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < arenas_seen && taken == 0; i++)
+	{
+		if (&arenas[i] != home && arena_has_room(&arenas[i], size_class))
+		{
+			taken = arena_take_blocks(&arenas[i], size_class, blocks, count);
+		}
+	}
+	// Every arena is full, grow by one more
+	while (taken == 0)
+	{
+		pthread_mutex_lock(&arenas_lock);
+		Arena *arena = arena_count > arenas_seen ? &arenas[arena_count - 1] : arena_create();
+		arenas_seen = arena_count;
+		pthread_mutex_unlock(&arenas_lock);
+		if (arena == NULL)
+		{
+			break;
+		}
+		taken = arena_take_blocks(arena, size_class, blocks, count);
+	}
+	return taken;
+}
+
+// Helper function to give blocks of the given size class back to their arenas. Blocks of the arena of the calling
+// thread are freed under its lock, the others go on the remote free list of their arena one run at a time.
+static void arena_free_blocks(int size_class, void **blocks, int count)
+{
+	Arena *locked = NULL;
+	int i = 0;
+	while (i < count)
+	{
+		Arena *arena = arena_of(blocks[i]);
+		if (arena != thread_arena)
+		{
+			// Chain the run of blocks owned by this arena and publish it with a single CAS.
+			// Only buddy blocks record their order, an 8-byte slab object has room for the link alone.
+			RemoteBlock *first = blocks[i];
+			RemoteBlock *last = first;
+			if (size_class >= SLAB_CLASSES)
+			{
+				first->order = size_class - SLAB_CLASSES;
+			}
+			while (++i < count && arena_of(blocks[i]) == arena)
+			{
+				last->next = blocks[i];
+				last = last->next;
+				if (size_class >= SLAB_CLASSES)
+				{
+					last->order = size_class - SLAB_CLASSES;
+				}
+			}
+			remote_free_push(arena, first, last);
+			continue;
+		}
+		if (arena != locked)
+		{
+			if (locked != NULL)
+			{
+				pthread_mutex_unlock(&locked->lock);
+			}
+			pthread_mutex_lock(&arena->lock);
+			locked = arena;
+		}
+		arena_release_block(arena, size_class, blocks[i]);
+		i++;
+	}
+	if (locked != NULL)
+	{
+		pthread_mutex_unlock(&locked->lock);
+	}
+}
+
+/*THREAD CACHE*/
+
+// Helper function to give every block in a thread cache back to the arenas
+static void thread_cache_release(void *arg)
+{
+	ThreadCache *cache = arg;
+	if (cache->generation != __atomic_load_n(&allocator_generation, __ATOMIC_ACQUIRE))
+	{
+		// The blocks belong to a destroyed allocator, the current one must not get them
+		memset(cache->count, 0, sizeof(cache->count));
+		return;
+	}
+	for (int size_class = 0; size_class < CACHE_CLASSES; size_class++)
+	{
+		arena_free_blocks(size_class, cache->blocks[size_class], cache->count[size_class]);
+		cache->count[size_class] = 0;
+	}
+}
+
+static void thread_cache_create_key()
+{
+	pthread_key_create(&thread_cache_key, thread_cache_release);
+}
+
+// Helper function to make sure the cache of this thread is released when the thread exits
+static void thread_cache_register(ThreadCache *cache)
+{
+	// Marked first: pthread_setspecific may allocate, and that allocation must not register the cache again
+	cache->registered = true;
+	pthread_once(&thread_cache_once, thread_cache_create_key);
+	pthread_setspecific(thread_cache_key, cache);
+}
+
+// Helper function to fill the thread cache with a batch of blocks of the given size class.
+// Kept out of line, so the allocation fast path that calls it does not pay for its registers.
+static __attribute__((noinline)) int thread_cache_refill(ThreadCache *cache, int size_class)
+{
+	if (!cache->registered)
+	{
+		thread_cache_register(cache);
+	}
+	void **blocks = cache->blocks[size_class] + cache->count[size_class];
+	int taken = arena_alloc_blocks(size_class, blocks, CACHE_BATCH - cache->count[size_class]);
+	// Blocks come out of the arena in address order, reverse them so the cache hands them out in that order
+	for (int i = 0; i < taken / 2; i++)
+	{
+		void *block = blocks[i];
+		blocks[i] = blocks[taken - 1 - i];
+		blocks[taken - 1 - i] = block;
+	}
+	cache->count[size_class] += taken;
+	return cache->count[size_class];
+}
+
+// Helper function to give the oldest batch of cached blocks of the given size class back to the arenas
+static void thread_cache_flush(ThreadCache *cache, int size_class)
+{
+	if (!cache->registered)
+	{
+		thread_cache_register(cache);
+	}
+	arena_free_blocks(size_class, cache->blocks[size_class], CACHE_BATCH);
+	cache->count[size_class] -= CACHE_BATCH;
+	memmove(cache->blocks[size_class], cache->blocks[size_class] + CACHE_BATCH, (size_t)cache->count[size_class] * sizeof(void *));
+}
+
+// Helper function to check if a block is in an array of blocks
+static bool blocks_contain(void **blocks, int count, void *block)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (blocks[i] == block)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Helper function to check if the thread caches hold blocks of a size class, only the first cache_orders buddy orders
+// have a cache
+static inline bool thread_cache_serves(int size_class)
+{
+	return size_class < SLAB_CLASSES + cache_orders;
+}
+
+// Helper function to check if a block carrying the cache key really is in the thread cache
+static bool thread_cache_contains(ThreadCache *cache, int size_class, void *block)
+{
+	return thread_cache_serves(size_class) && blocks_contain(cache->blocks[size_class], cache->count[size_class], block);
+}
+
+// Helper function to serve a block of the given size class from the thread cache
+static inline void *thread_cache_alloc(int size_class, size_t size)
+{
+	ThreadCache *cache = thread_cache_current();
+	if (cache->count[size_class] == 0 && thread_cache_refill(cache, size_class) == 0)
+	{
+		// Fall back on large allocation if no free block is found
+		return large_alloc(size);
+	}
+	void *block = cache->blocks[size_class][--cache->count[size_class]];
+	*(uintptr_t *)block = 0;
+	stats_alloc(size_class, size, 1);
+	return block;
+}
+
+// Helper function to put a freed block of the given size class in the thread cache
+static int thread_cache_free(int size_class, void *block)
+{
+	ThreadCache *cache = thread_cache_current();
+	if (*(uintptr_t *)block == CACHED_BLOCK_KEY && thread_cache_contains(cache, size_class, block))
+	{
+		// Double free of a block that is still in the cache
+		errno = EINVAL;
+		return -1;
+	}
+	if (cache->count[size_class] == CACHE_SIZE)
+	{
+		thread_cache_flush(cache, size_class);
+	}
+	*(uintptr_t *)block = CACHED_BLOCK_KEY;
+	cache->blocks[size_class][cache->count[size_class]++] = block;
+	stats_free(size_class, 1);
+	return 0;
+}
+
+// Give the blocks cached by the calling thread back to the arenas, take in the blocks other threads
+// freed into its arena and give its empty slabs back to the buddy memory
+void pseudo_flush_thread_cache()
+{
+	thread_cache_release(thread_cache_current());
+	Arena *arena = thread_arena;
+	if (arena != NULL)
+	{
+		pthread_mutex_lock(&arena->lock);
+		remote_free_drain(arena);
+		slab_release_empty(arena);
+		pthread_mutex_unlock(&arena->lock);
+	}
+}
+
+// Set how long a free arena block stays resident before it is purged, 0 purges blocks as soon as they are freed
+void pseudo_set_decay_time(size_t milliseconds)
+{
+	__atomic_store_n(&decay_time, (uint64_t)milliseconds * 1000000, __ATOMIC_RELAXED);
+}
+
+// Give the pages of every free arena block back to the kernel now, without waiting for them to decay, and drop
+// the pages of the cached large mappings. The caller's thread cache is flushed first, the other threads keep theirs.
+// Returns the bytes given back.
+size_t pseudo_malloc_trim()
+{
+	pseudo_flush_thread_cache();
+	size_t trimmed = 0;
+	int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; i++)
+	{
+		Arena *arena = &arenas[i];
+		pthread_mutex_lock(&arena->lock);
+		remote_free_drain(arena);
+		slab_release_empty(arena);
+		trimmed += arena_purge(arena, UINT64_MAX);
+		pthread_mutex_unlock(&arena->lock);
+	}
+	pthread_mutex_lock(&large_cache_lock);
+	for (int slot = 0; slot < LARGE_CACHE_SLOTS; slot++)
+	{
+		if (large_cache[slot].mapping != NULL && large_cache[slot].resident)
+		{
+			trimmed += large_cache[slot].length;
+			large_cache_decommit(&large_cache[slot], false);
+		}
+	}
+	pthread_mutex_unlock(&large_cache_lock);
+	return trimmed;
+}
+
+// Slab allocator function
+void *slab_alloc(size_t size)
+{
+	return thread_cache_alloc(pseudo_slab_class(size), size);
+}
+
+// Buddy allocator function
+void *buddy_alloc(size_t size)
+{
+	int index = get_buddy_index(size);
+	void *block;
+
+	if (index < cache_orders)
+	{
+		return thread_cache_alloc(SLAB_CLASSES + index, size);
+	}
+
+	if (arena_alloc_blocks(SLAB_CLASSES + index, &block, 1) == 0)
+	{
+		// Fall back on large allocation if no free block is found
+		return large_alloc(size);
+	}
+	stats_alloc(SLAB_CLASSES + index, size, 1);
+	return block;
+}
+
+// Helper function to allocate a block of any size, without tracing the call
+static void *malloc_untraced(size_t size)
+{
+	if (size <= 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	else if (size <= SLAB_MAX_SIZE)
+	{
+		return slab_alloc(size);
+	}
+	else if (size < small_threshold)
+	{
+		return buddy_alloc(size);
+	}
+	else
+	{
+		return large_alloc(size);
+	}
+}
+
+// Custom malloc function
+void *pseudo_malloc(size_t size)
+{
+	void *ptr = malloc_untraced(size);
+	trace_call(TRACE_MALLOC, ptr, 0, size);
+	return ptr;
+}
+
+// Helper function to serve pseudo_malloc_slab when its fast path cannot: a size class that is not a slab one, an empty
+// cache, a cache of a destroyed allocator, counters not registered yet or a trace being recorded
+static __attribute__((noinline, cold)) void *malloc_slab_slow(int size_class, size_t size)
+{
+	if ((unsigned int)size_class >= SLAB_CLASSES)
+	{
+		return pseudo_malloc(size);
+	}
+	void *ptr = thread_cache_alloc(size_class, size);
+	trace_call(TRACE_MALLOC, ptr, 0, size);
+	return ptr;
+}
+
+// Helper function to update the shared usage once the fast path of pseudo_malloc_slab reached STATS_FLUSH_BYTES
+static __attribute__((noinline, cold)) void *malloc_slab_flush(ThreadStats *stats, void *block)
+{
+	stats_usage(stats, 0);
+	return block;
+}
+
+// Slab allocation with the size class already resolved, called by pseudo_malloc_inline for 1 to SLAB_MAX_SIZE bytes.
+// The fast path pops the thread cache and bumps the counters of the thread. Everything else is a tail call to a cold
+// helper, so the function saves no registers and builds no frame.
+void *pseudo_malloc_slab(int size_class, size_t size)
+{
+	ThreadCache *cache = &thread_cache;
+	ThreadStats *stats = &thread_stats;
+	unsigned int slot = (unsigned int)size_class;
+	if (__builtin_expect(slot >= SLAB_CLASSES || cache->count[slot] == 0 || !stats->registered ||
+							 cache->generation != __atomic_load_n(&allocator_generation, __ATOMIC_ACQUIRE) ||
+							 __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED),
+						 0))
+	{
+		return malloc_slab_slow(size_class, size);
+	}
+	void *block = cache->blocks[slot][--cache->count[slot]];
+	*(uintptr_t *)block = 0;
+	// The counters stats_alloc would update, the shared usage only when the bytes of the thread reach the threshold
+	stats_add(&stats->allocs[slot], 1);
+	stats_add(&stats->requested_bytes, size);
+	stats->pending_bytes += (long)1 << (SLAB_MIN_SHIFT + slot);
+	if (__builtin_expect(stats->pending_bytes >= STATS_FLUSH_BYTES, 0))
+	{
+		return malloc_slab_flush(stats, block);
+	}
+	return block;
+}
+
+// Custom bulk malloc function, fills ptrs with up to count blocks of the given size and returns how many it got.
+// Blocks of the arenas come straight from them, many at a time under one lock, instead of through the thread cache.
+size_t pseudo_malloc_bulk(size_t size, size_t count, void **ptrs)
+{
+	size_t allocated = 0;
+	if (size == 0)
+	{
+		errno = EINVAL;
+		return 0;
+	}
+	if (size < small_threshold)
+	{
+		int size_class = small_size_class(size);
+		ThreadCache *cache = thread_cache_current();
+		// Blocks already in the thread cache are the cheapest ones
+		while (allocated < count && thread_cache_serves(size_class) && cache->count[size_class] > 0)
+		{
+			ptrs[allocated++] = cache->blocks[size_class][--cache->count[size_class]];
+		}
+		while (allocated < count)
+		{
+			int batch = count - allocated < BULK_BATCH ? (int)(count - allocated) : BULK_BATCH;
+			int taken = arena_alloc_blocks(size_class, ptrs + allocated, batch);
+			if (taken == 0)
+			{
+				break;
+			}
+			allocated += (size_t)taken;
+		}
+		// Blocks that went through a thread cache still carry its key
+		for (size_t i = 0; i < allocated; i++)
+		{
+			*(uintptr_t *)ptrs[i] = 0;
+		}
+		if (allocated > 0)
+		{
+			stats_alloc(size_class, size, allocated);
+		}
+	}
+	// Fall back on large allocation for what the arenas could not serve
+	while (allocated < count && (ptrs[allocated] = large_alloc(size)) != NULL)
+	{
+		allocated++;
+	}
+	for (size_t i = 0; i < allocated; i++)
+	{
+		trace_call(TRACE_MALLOC, ptrs[i], 0, size);
+	}
+	return allocated;
+}
+
+/*FREE FUNCTION*/
+
+// Large free function
+int large_free(void *ptr)
+{
+	// The length comes from the large map, the pages of the block are not touched
+	size_t length = large_map_remove(ptr);
+	if (length == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	stats_large_free(length);
+	if (!large_cache_put(ptr, length) && munmap(ptr, length) == -1)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return 1;
+}
+
+// Helper function to free a buddy block whose order is known
+static int buddy_free_order(Arena *arena, void *ptr, int order)
+{
+	size_t offset = arena_offset(arena, ptr);
+	if (order < cache_orders)
+	{
+		return thread_cache_free(SLAB_CLASSES + order, ptr);
+	}
+
+	if (arena != thread_arena)
+	{
+		// The block belongs to another arena, leave it to the threads of that arena
+		RemoteBlock *block = ptr;
+		block->order = order;
+		remote_free_push(arena, block, block);
+		stats_free(SLAB_CLASSES + order, 1);
+		return 0;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	// Check again under the lock, another thread may have freed the block meanwhile
+	if (buddy_block_order(arena, offset) != order)
+	{
+		pthread_mutex_unlock(&arena->lock);
+		errno = EINVAL;
+		return -1;
+	}
+	buddy_free_block(arena, offset, order);
+	pthread_mutex_unlock(&arena->lock);
+	stats_free(SLAB_CLASSES + order, 1);
+
+	return 0;
+}
+
+// Buddy free function
+int buddy_free(Arena *arena, void *ptr)
+{
+	int order = buddy_block_order(arena, arena_offset(arena, ptr));
+	if (order == -1)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return buddy_free_order(arena, ptr, order);
+}
+
+// Slab free function
+int slab_free(void *ptr)
+{
+	int size_class = slab_object_class(ptr);
+	if (size_class == -1)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return thread_cache_free(size_class, ptr);
+}
+
+// Helper function to free a block of any kind, without tracing the call
+static int free_untraced(void *ptr)
+{
+	int ret = 1;
+	if (ptr == NULL)
+	{
+		return -1;
+	}
+	Arena *arena = arena_of(ptr);
+	if (arena != NULL && arena_is_slab(arena, arena_offset(arena, ptr)))
+	{
+		if (slab_free(ptr) == -1)
+		{
+			ret = -1;
+		}
+	}
+	else if (arena != NULL)
+	{
+		if (buddy_free(arena, ptr) == -1)
+		{
+			ret = -1;
+		}
+	}
+	else
+	{
+		if (large_free(ptr) == -1)
+		{
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+// Custom free function
+int pseudo_free(void *ptr)
+{
+	int ret = free_untraced(ptr);
+	if (ret != -1)
+	{
+		trace_call(TRACE_FREE, ptr, 0, 0);
+	}
+	return ret;
+}
+
+// Helper function to free a block whose size is known, without tracing the call
+static int free_sized_untraced(void *ptr, size_t size)
+{
+	Arena *arena = arena_of(ptr);
+	if (arena == NULL || size == 0 || size >= small_threshold)
+	{
+		return free_untraced(ptr);
+	}
+	size_t offset = arena_offset(arena, ptr);
+	int size_class = small_size_class(size);
+	if (size_class < SLAB_CLASSES)
+	{
+		if (arena_is_slab(arena, offset) && slab_object_class(ptr) == size_class)
+		{
+			return thread_cache_free(size_class, ptr) == -1 ? -1 : 1;
+		}
+	}
+	else
+	{
+		// The block has this order if its node is set and neither of its halves is
+		int order = size_class - SLAB_CLASSES;
+		size_t node = node_index(offset, order);
+		if (arena_get_bitmap(arena, node) && (order == 0 || arena_halves_free(arena, node)))
+		{
+			return buddy_free_order(arena, ptr, order) == -1 ? -1 : 1;
+		}
+	}
+	return free_untraced(ptr);
+}
+
+// Custom sized free function, the size given to pseudo_malloc spares the search of the block order.
+// A size that does not match the block, like the one of a block resized in place, falls back on pseudo_free.
+int pseudo_free_sized(void *ptr, size_t size)
+{
+	int ret = free_sized_untraced(ptr, size);
+	if (ret != -1)
+	{
+		trace_call(TRACE_FREE, ptr, 0, 0);
+	}
+	return ret;
+}
+
+// Helper function to get the size class of an allocated slab object or buddy block of an arena, -1 if it is neither
+static int arena_block_class(Arena *arena, void *ptr)
+{
+	size_t offset = arena_offset(arena, ptr);
+	if (arena_is_slab(arena, offset))
+	{
+		return slab_object_class(ptr);
+	}
+	int order = buddy_block_order(arena, offset);
+	return order == -1 ? -1 : SLAB_CLASSES + order;
+}
+
+// Custom bulk free function, returns -1 if one of the pointers was not allocated, the others are freed anyway.
+// Blocks of the arenas skip the thread cache: runs of the same size class go back to their arena under one lock,
+// or to another arena with one remote push.
+int pseudo_free_bulk(void **ptrs, size_t count)
+{
+	ThreadCache *cache = thread_cache_current();
+	void *batch[BULK_BATCH];
+	int batch_class = -1;
+	int batched = 0;
+	int ret = 1;
+	for (size_t i = 0; i < count; i++)
+	{
+		Arena *arena = arena_of(ptrs[i]);
+		if (arena == NULL)
+		{
+			if (large_free(ptrs[i]) == -1)
+			{
+				ret = -1;
+			}
+			continue;
+		}
+		int size_class = arena_block_class(arena, ptrs[i]);
+		// Batched blocks carry the cache key too, so a block given twice is found like a double free of a cached one
+		if (size_class == -1 || (*(uintptr_t *)ptrs[i] == CACHED_BLOCK_KEY &&
+								 (thread_cache_contains(cache, size_class, ptrs[i]) || (size_class == batch_class && blocks_contain(batch, batched, ptrs[i])))))
+		{
+			errno = EINVAL;
+			ret = -1;
+			continue;
+		}
+		if (size_class != batch_class || batched == BULK_BATCH)
+		{
+			if (batched > 0)
+			{
+				arena_free_blocks(batch_class, batch, batched);
+				stats_free(batch_class, (size_t)batched);
+			}
+			batch_class = size_class;
+			batched = 0;
+		}
+		*(uintptr_t *)ptrs[i] = CACHED_BLOCK_KEY;
+		batch[batched++] = ptrs[i];
+	}
+	if (batched > 0)
+	{
+		arena_free_blocks(batch_class, batch, batched);
+		stats_free(batch_class, (size_t)batched);
+	}
+	// Pointers that were not allocated are traced too, a replay does not know them and skips them
+	for (size_t i = 0; i < count; i++)
+	{
+		trace_call(TRACE_FREE, ptrs[i], 0, 0);
+	}
+	return ret;
+}
+
+/*ALIGNED MALLOC FUNCTIONS*/
+
+// Helper function to allocate an aligned block, the alignment must be a power of two
+static void *memalign_untraced(size_t alignment, size_t size)
+{
+	if (size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	// Slab objects and buddy blocks are aligned to their size, so a block as large as the alignment is aligned
+	if (size < alignment)
+	{
+		size = alignment;
+	}
+	if (size < small_threshold)
+	{
+		void *ptr = malloc_untraced(size);
+		// Without room in the arenas the block comes from large_alloc, which is only page aligned
+		if (ptr == NULL || ((uintptr_t)ptr & (alignment - 1)) == 0)
+		{
+			return ptr;
+		}
+		free_untraced(ptr);
+	}
+	return large_aligned_alloc(size, alignment);
+}
+
+// Custom aligned malloc function, the alignment must be a power of two
+void *pseudo_memalign(size_t alignment, size_t size)
+{
+	void *ptr = memalign_untraced(alignment, size);
+	trace_call(TRACE_MEMALIGN, ptr, alignment, size);
+	return ptr;
+}
+
+// Custom C11 aligned_alloc function, the size must be a multiple of the alignment
+void *pseudo_aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || size % alignment != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	return pseudo_memalign(alignment, size);
+}
+
+/*REALLOC FUNCTIONS*/
+
+// Helper function to move a block to a new allocation, copying the bytes both can hold
+static void *realloc_move(void *ptr, size_t capacity, size_t size)
+{
+	void *new_ptr = malloc_untraced(size);
+	if (new_ptr == NULL)
+	{
+		return NULL;
+	}
+	memcpy(new_ptr, ptr, size < capacity ? size : capacity);
+	free_untraced(ptr);
+	return new_ptr;
+}
+
+// Large realloc function
+void *large_realloc(void *ptr, size_t size)
+{
+	size_t total_size = large_map_find(ptr);
+	if (total_size == 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if (size < small_threshold)
+	{
+		// Small enough for the arenas, copying it is cheaper than keeping a whole mapping
+		return realloc_move(ptr, total_size, size);
+	}
+	size_t new_total_size = large_length(size);
+	if (new_total_size == 0)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (new_total_size == total_size)
+	{
+		return ptr;
+	}
+	// The kernel moves the page tables instead of the bytes, and shrinking never moves.
+	// The map is locked across the call: once mremap gives the old range back, another thread may get it from mmap,
+	// and its entry must not go in before the one of ptr is gone.
+	pthread_mutex_lock(&large_map_lock);
+	void *new_ptr = mremap(ptr, total_size, new_total_size, MREMAP_MAYMOVE);
+	if (new_ptr != MAP_FAILED)
+	{
+		// The entry was there and the lock was held, so putting it back cannot need a larger table
+		large_map_delete(ptr);
+		large_map_put(new_ptr, new_total_size);
+	}
+	pthread_mutex_unlock(&large_map_lock);
+	if (new_ptr == MAP_FAILED)
+	{
+		// A hugetlb mapping cannot be cut in the middle of a huge page, it keeps its size
+		if (size <= total_size)
+		{
+			return ptr;
+		}
+		return realloc_move(ptr, total_size, size);
+	}
+	// Counted as a free and an allocation, like a block that moves
+	stats_large_free(total_size);
+	stats_large_alloc(size, new_total_size);
+	return new_ptr;
+}
+
+// Buddy realloc function
+void *buddy_realloc(Arena *arena, void *ptr, size_t size)
+{
+	size_t offset = arena_offset(arena, ptr);
+	int order = buddy_block_order(arena, offset);
+	if (order == -1)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t capacity = min_block_size << order;
+	if (size > BUDDY_GROW_MAX_SIZE || size > arena_size)
+	{
+		return realloc_move(ptr, capacity, size);
+	}
+	int new_order = get_buddy_index(size);
+	if (new_order == order)
+	{
+		return ptr;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	// Blocks freed by other threads may be the buddies needed to grow
+	remote_free_drain(arena);
+	bool resized = buddy_resize_block(arena, offset, order, new_order);
+	pthread_mutex_unlock(&arena->lock);
+	if (resized)
+	{
+		stats_free(SLAB_CLASSES + order, 1);
+		stats_alloc(SLAB_CLASSES + new_order, size, 1);
+		return ptr;
+	}
+
+	// Move to a block split from a larger free one rather than a cached block, its buddies are free to grow into
+	void *new_ptr;
+	if (arena_alloc_blocks(SLAB_CLASSES + new_order, &new_ptr, 1) == 0)
+	{
+		return realloc_move(ptr, capacity, size);
+	}
+	stats_alloc(SLAB_CLASSES + new_order, size, 1);
+	memcpy(new_ptr, ptr, size < capacity ? size : capacity);
+	free_untraced(ptr);
+	return new_ptr;
+}
+
+// Helper function to resize a block, without tracing the call
+static void *realloc_untraced(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+	{
+		return malloc_untraced(size);
+	}
+	if (size == 0)
+	{
+		free_untraced(ptr);
+		return NULL;
+	}
+	Arena *arena = arena_of(ptr);
+	if (arena != NULL && arena_is_slab(arena, arena_offset(arena, ptr)))
+	{
+		int size_class = slab_object_class(ptr);
+		if (size_class == -1)
+		{
+			errno = EINVAL;
+			return NULL;
+		}
+		// Slab objects cannot grow, but a smaller size fits in the same object
+		size_t capacity = (size_t)1 << (SLAB_MIN_SHIFT + size_class);
+		if (size <= capacity)
+		{
+			return ptr;
+		}
+		return realloc_move(ptr, capacity, size);
+	}
+	else if (arena != NULL)
+	{
+		return buddy_realloc(arena, ptr, size);
+	}
+	else
+	{
+		return large_realloc(ptr, size);
+	}
+}
+
+// Custom realloc function
+void *pseudo_realloc(void *ptr, size_t size)
+{
+	void *new_ptr = realloc_untraced(ptr, size);
+	// A size of 0 frees the block, any other size failed if there is no new block
+	if (new_ptr != NULL || size == 0)
+	{
+		trace_call(TRACE_REALLOC, new_ptr, (uintptr_t)ptr, size);
+	}
+	return new_ptr;
+}
+
+// Custom malloc_usable_size function, the bytes the block of ptr can hold or 0 if ptr is not allocated
+size_t pseudo_malloc_usable_size(void *ptr)
+{
+	if (ptr == NULL)
+	{
+		return 0;
+	}
+	Arena *arena = arena_of(ptr);
+	if (arena != NULL && arena_is_slab(arena, arena_offset(arena, ptr)))
+	{
+		int size_class = slab_object_class(ptr);
+		return size_class == -1 ? 0 : (size_t)1 << (SLAB_MIN_SHIFT + size_class);
+	}
+	else if (arena != NULL)
+	{
+		int order = buddy_block_order(arena, arena_offset(arena, ptr));
+		return order == -1 ? 0 : min_block_size << order;
+	}
+	else
+	{
+		return large_map_find(ptr);
+	}
+}
+
+// Tell whether a block lies in the arenas. Their memory stays mapped until destroy_buddy_allocator, so it
+// can still be read after the block is freed, unlike a large mapping that free may give back to the kernel.
+bool pseudo_in_arena(const void *ptr)
+{
+	return arena_of(ptr) != NULL;
+}
+
+/*POOLS*/
+
+// Header at the base of each block of a pool, linking the blocks for pseudo_pool_destroy
+typedef struct PoolBlock
+{
+	struct PoolBlock *next;
+} PoolBlock;
+
+// A pool of equal objects carved from buddy blocks. Free objects are linked through their first word, so the
+// objects carry no metadata. A new block is carved lazily, objects are handed out from next_object as needed.
+struct PseudoPool
+{
+	void *free_objects;  // Freed objects, each one holding the next
+	char *next_object;   // Next object never handed out of the newest block
+	char *end_object;    // End of the objects of the newest block
+	size_t object_size;  // Bytes of an object, a multiple of the alignment
+	size_t block_size;   // Bytes of a block, a power of two
+	size_t header_size;  // Bytes before the first object of a block, the PoolBlock rounded up to the alignment
+	PoolBlock *blocks;   // Blocks of the pool, newest first
+};
+
+// Create a pool of objects of the given size and alignment, a power of two up to PAGE_SIZE or 0 for pointer alignment.
+// A pool is not thread-safe: one thread uses it at a time, like the structure it serves.
+PseudoPool *pseudo_pool_create(size_t object_size, size_t alignment)
+{
+	if (alignment == 0)
+	{
+		alignment = sizeof(void *);
+	}
+	if (object_size == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGE_SIZE || object_size > arena_size)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	PseudoPool *pool = malloc_untraced(sizeof(PseudoPool));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	// An object must hold the link of the free list
+	size_t size = object_size < sizeof(void *) ? sizeof(void *) : object_size;
+	pool->object_size = (size + alignment - 1) & ~(alignment - 1);
+	pool->header_size = (sizeof(PoolBlock) + alignment - 1) & ~(alignment - 1);
+	pool->block_size = POOL_BLOCK_SIZE;
+	while (pool->block_size < pool->header_size + POOL_MIN_OBJECTS * pool->object_size)
+	{
+		pool->block_size *= 2;
+	}
+	pool->free_objects = NULL;
+	pool->next_object = NULL;
+	pool->end_object = NULL;
+	pool->blocks = NULL;
+	return pool;
+}
+
+// Helper function to add a block to a pool and hand out its first object, NULL if there is no memory left
+static void *pool_grow(PseudoPool *pool)
+{
+	// Buddy blocks are aligned to their size, larger than the arenas they come from large_alloc and its pages
+	PoolBlock *block = buddy_alloc(pool->block_size);
+	if (block == NULL)
+	{
+		return NULL;
+	}
+	block->next = pool->blocks;
+	pool->blocks = block;
+	size_t count = (pool->block_size - pool->header_size) / pool->object_size;
+	pool->next_object = (char *)block + pool->header_size + pool->object_size;
+	pool->end_object = (char *)block + pool->header_size + count * pool->object_size;
+	return (char *)block + pool->header_size;
+}
+
+// Allocate an object from a pool, a freed one first, then one never handed out
+void *pseudo_pool_alloc(PseudoPool *pool)
+{
+	void *object = pool->free_objects;
+	if (object != NULL)
+	{
+		pool->free_objects = *(void **)object;
+		return object;
+	}
+	if (pool->next_object < pool->end_object)
+	{
+		object = pool->next_object;
+		pool->next_object += pool->object_size;
+		return object;
+	}
+	return pool_grow(pool);
+}
+
+// Give an object back to the pool it came from, it stays in the pool until pseudo_pool_destroy
+void pseudo_pool_free(PseudoPool *pool, void *ptr)
+{
+	if (ptr != NULL)
+	{
+		*(void **)ptr = pool->free_objects;
+		pool->free_objects = ptr;
+	}
+}
+
+// Destroy a pool and every object in it, its blocks go back to the arenas in batches of one size class
+void pseudo_pool_destroy(PseudoPool *pool)
+{
+	int size_class = SLAB_CLASSES + get_buddy_index(pool->block_size);
+	void *batch[BULK_BATCH];
+	int batched = 0;
+	PoolBlock *block = pool->blocks;
+	while (block != NULL)
+	{
+		PoolBlock *next = block->next;
+		if (arena_of(block) == NULL)
+		{
+			large_free(block);
+		}
+		else
+		{
+			batch[batched++] = block;
+		}
+		if (batched == BULK_BATCH || (next == NULL && batched > 0))
+		{
+			arena_free_blocks(size_class, batch, batched);
+			stats_free(size_class, (size_t)batched);
+			batched = 0;
+		}
+		block = next;
+	}
+	free_untraced(pool);
+}
+
+/*REGIONS*/
+
+// Header at the base of each chunk of a region, its allocations follow it
+typedef struct RegionChunk
+{
+	struct RegionChunk *prev;
+	size_t size;
+} RegionChunk;
+
+_Static_assert(sizeof(RegionChunk) % REGION_ALIGN == 0, "Region allocations start right after the chunk header");
+
+// A region hands out memory by bumping cursor through its newest chunk, everything is freed at once
+struct PseudoRegion
+{
+	char *cursor;          // Next free byte of the newest chunk
+	char *limit;           // End of the newest chunk
+	RegionChunk *chunks;   // Newest chunk, linked to the older ones
+	size_t next_size;      // Size of the next chunk, doubled up to REGION_MAX_CHUNK_SIZE
+};
+
+// Create a region whose first chunk holds at least initial_size bytes, 0 for REGION_CHUNK_SIZE.
+// Like a pool, a region is used by one thread at a time.
+PseudoRegion *pseudo_region_create(size_t initial_size)
+{
+	PseudoRegion *region = malloc_untraced(sizeof(PseudoRegion));
+	if (region == NULL)
+	{
+		return NULL;
+	}
+	size_t size = REGION_CHUNK_SIZE;
+	while (size < initial_size + sizeof(RegionChunk) && size < REGION_MAX_CHUNK_SIZE)
+	{
+		size *= 2;
+	}
+	region->cursor = NULL;
+	region->limit = NULL;
+	region->chunks = NULL;
+	region->next_size = size;
+	return region;
+}
+
+// Helper function to free the chunks of a region from chunk down to, but not including, last
+static void region_free_chunks(RegionChunk *chunk, RegionChunk *last)
+{
+	while (chunk != last)
+	{
+		RegionChunk *prev = chunk->prev;
+		free_untraced(chunk);
+		chunk = prev;
+	}
+}
+
+// Helper function to start a new chunk that holds at least size bytes and allocate them from it.
+// Chunks up to the size of an arena are buddy blocks, larger ones come from large_alloc through buddy_alloc.
+static void *region_grow(PseudoRegion *region, size_t size)
+{
+	size_t chunk_size = region->next_size;
+	if (size > chunk_size - sizeof(RegionChunk))
+	{
+		// A request larger than the chunks gets a chunk of its own, rounded to pages
+		chunk_size = (size + sizeof(RegionChunk) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+	}
+	RegionChunk *chunk = buddy_alloc(chunk_size);
+	if (chunk == NULL)
+	{
+		return NULL;
+	}
+	chunk->prev = region->chunks;
+	chunk->size = chunk_size;
+	region->chunks = chunk;
+	region->cursor = (char *)(chunk + 1) + size;
+	region->limit = (char *)chunk + chunk_size;
+	if (region->next_size < REGION_MAX_CHUNK_SIZE)
+	{
+		region->next_size *= 2;
+	}
+	return chunk + 1;
+}
+
+// Allocate size bytes from a region, aligned to REGION_ALIGN. They are freed with the region, on reset or rollback.
+void *pseudo_region_alloc(PseudoRegion *region, size_t size)
+{
+	if (size > SIZE_MAX / 2)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	// A size of 0 still gets its own bytes, so every pointer is unique
+	size = size == 0 ? REGION_ALIGN : (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+	if ((size_t)(region->limit - region->cursor) >= size)
+	{
+		void *ptr = region->cursor;
+		region->cursor += size;
+		return ptr;
+	}
+	return region_grow(region, size);
+}
+
+// Remember the current end of a region, pseudo_region_rollback frees everything allocated after it
+PseudoRegionMark pseudo_region_save(PseudoRegion *region)
+{
+	PseudoRegionMark mark = {region->chunks, region->cursor};
+	return mark;
+}
+
+// Free everything allocated from a region since the mark was saved. Marks saved after this one, and marks
+// saved before a reset, can no longer be used.
+void pseudo_region_rollback(PseudoRegion *region, PseudoRegionMark mark)
+{
+	RegionChunk *chunk = mark.chunk;
+	region_free_chunks(region->chunks, chunk);
+	region->chunks = chunk;
+	region->cursor = mark.cursor;
+	region->limit = chunk == NULL ? NULL : (char *)chunk + chunk->size;
+}
+
+// Free everything allocated from a region. The newest chunk is kept for the next allocations unless it is one
+// of a large request, so a region reset after each request settles on a single chunk and resets in O(1).
+void pseudo_region_reset(PseudoRegion *region)
+{
+	RegionChunk *keep = region->chunks;
+	if (keep != NULL && keep->size > REGION_MAX_CHUNK_SIZE)
+	{
+		keep = NULL;
+	}
+	region_free_chunks(region->chunks, keep);
+	if (keep != NULL)
+	{
+		region_free_chunks(keep->prev, NULL);
+		keep->prev = NULL;
+	}
+	region->chunks = keep;
+	region->cursor = keep == NULL ? NULL : (char *)(keep + 1);
+	region->limit = keep == NULL ? NULL : (char *)keep + keep->size;
+}
+
+// Destroy a region and everything allocated from it
+void pseudo_region_destroy(PseudoRegion *region)
+{
+	region_free_chunks(region->chunks, NULL);
+	free_untraced(region);
+}
+
+/*BUDDY_MEMORY*/
+
+// Helper function to read a size from an environment variable, with an optional K, M or G suffix, 0 if it is not set
+static size_t env_size(const char *name)
+{
+	const char *value = getenv(name);
+	if (value == NULL)
+	{
+		return 0;
+	}
+	char *end;
+	unsigned long long size = strtoull(value, &end, 0);
+	switch (*end)
+	{
+	case 'g':
+	case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		size <<= 10;
+	}
+	return (size_t)size;
+}
+
+// Helper function to check if a size is a power of two
+static bool is_power_of_two(size_t size)
+{
+	return size != 0 && (size & (size - 1)) == 0;
+}
+
+// Fill a configuration with the default geometry, overridden by the PSEUDO_MALLOC_* environment variables
+void pseudo_default_config(BuddyConfig *config)
+{
+	config->arena_size = env_size("PSEUDO_MALLOC_ARENA_SIZE");
+	config->min_block_size = env_size("PSEUDO_MALLOC_MIN_BLOCK_SIZE");
+	config->small_threshold = env_size("PSEUDO_MALLOC_SMALL_THRESHOLD");
+	config->commit_size = env_size("PSEUDO_MALLOC_COMMIT_SIZE");
+	config->max_arenas = (int)env_size("PSEUDO_MALLOC_MAX_ARENAS");
+	if (config->arena_size == 0)
+	{
+		config->arena_size = BUDDY_MEMORY_SIZE;
+	}
+	if (config->min_block_size == 0)
+	{
+		config->min_block_size = MIN_BLOCK_SIZE;
+	}
+	if (config->small_threshold == 0)
+	{
+		config->small_threshold = SMALL_THRESHOLD;
+	}
+	if (config->commit_size == 0)
+	{
+		config->commit_size = COMMIT_SIZE;
+	}
+	if (config->max_arenas == 0)
+	{
+		config->max_arenas = MAX_ARENAS;
+	}
+}
+
+// Helper function to check a geometry and make it the one of the arenas
+static int set_geometry(const BuddyConfig *config)
+{
+	size_t commit = config->commit_size < config->arena_size ? config->commit_size : config->arena_size;
+	if (!is_power_of_two(config->arena_size) || config->arena_size < 16 * PAGE_SIZE || config->arena_size > MAX_ARENA_SIZE ||
+		!is_power_of_two(config->min_block_size) || config->min_block_size <= SLAB_MAX_SIZE || config->min_block_size > SLAB_SIZE ||
+		config->small_threshold <= SLAB_MAX_SIZE || config->small_threshold > config->arena_size ||
+		!is_power_of_two(commit) || commit < SLAB_SIZE || config->max_arenas < 1 || config->max_arenas > MAX_ARENAS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	// The reserved range, max_arenas arenas and the slack to align them, must fit in half the address space.
+	// On 32-bit, the largest arenas only fit a few at a time.
+	if (__builtin_ctzl(config->arena_size) + pseudo_size_shift((size_t)config->max_arenas) >= (int)(sizeof(size_t) * 8) - 1)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	arena_size = config->arena_size;
+	arena_shift = __builtin_ctzl(arena_size);
+	min_block_size = config->min_block_size;
+	min_block_shift = __builtin_ctzl(min_block_size);
+	max_order = arena_shift - min_block_shift;
+	if (max_order >= MAX_LEVELS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	small_threshold = config->small_threshold;
+	cache_orders = get_buddy_index(small_threshold - 1) + 1;
+	if (cache_orders > CACHE_MAX_ORDERS)
+	{
+		// The larger orders of the small path go straight to the arenas
+		cache_orders = CACHE_MAX_ORDERS;
+	}
+	slab_order = __builtin_ctzl(SLAB_SIZE) - min_block_shift;
+	// Purging a block keeps its first page, so only blocks of two pages and more give something back
+	purge_order = __builtin_ctzl(2 * PAGE_SIZE) - min_block_shift;
+	commit_size = commit;
+	max_arenas = config->max_arenas;
+	total_nodes = 2 * (arena_size >> min_block_shift) - 1;
+	bitmap_words = (total_nodes + 1 + 63) / 64;
+	slab_map_words = (arena_size / SLAB_SIZE + 63) / 64;
+	return 0;
+}
+
+// Constructor function to initialize buddy allocator with the default geometry and the environment overrides
+int init_buddy_allocator()
+{
+	return init_buddy_allocator_config(NULL);
+}
+
+// Constructor function to initialize buddy allocator with the given geometry, the fields left at 0 keep their default
+int init_buddy_allocator_config(const BuddyConfig *config)
+{
+	BuddyConfig geometry;
+	pseudo_default_config(&geometry);
+	if (config != NULL)
+	{
+		geometry.arena_size = config->arena_size != 0 ? config->arena_size : geometry.arena_size;
+		geometry.min_block_size = config->min_block_size != 0 ? config->min_block_size : geometry.min_block_size;
+		geometry.small_threshold = config->small_threshold != 0 ? config->small_threshold : geometry.small_threshold;
+		geometry.commit_size = config->commit_size != 0 ? config->commit_size : geometry.commit_size;
+		geometry.max_arenas = config->max_arenas != 0 ? config->max_arenas : geometry.max_arenas;
+	}
+	if (set_geometry(&geometry) == -1)
+	{
+		return (-1);
+	}
+
+	// Reserve address space for every arena, aligned to the arena size so blocks are naturally aligned,
+	// and to the huge page size so arenas can be backed by huge pages
+	size_t reserved = (size_t)max_arenas << arena_shift;
+	arena_space = map_aligned(reserved, arena_size > HUGE_PAGE_SIZE ? arena_size : HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+	if (arena_space == MAP_FAILED)
+	{
+		arena_space = NULL;
+		return (-1);
+	}
+
+	arena_count = 0;
+	assigned_arenas = 0;
+	memset(cpu_arena, 0, sizeof(cpu_arena));
+	select_bitmap_kernel();
+	large_cache_clear();
+	// The first arena is created eagerly, the others when cpus start allocating
+	pthread_mutex_lock(&arenas_lock);
+	Arena *arena = arena_create();
+	pthread_mutex_unlock(&arenas_lock);
+	if (arena == NULL)
+	{
+		munmap(arena_space, reserved);
+		return (-1);
+	}
+	// The decay time can be set from the environment, in milliseconds
+	const char *decay = getenv("PSEUDO_MALLOC_DECAY_MS");
+	if (decay != NULL && decay[0] != '\0')
+	{
+		pseudo_set_decay_time(strtoull(decay, NULL, 0));
+	}
+	// A trace is recorded from the start when its file is given in the environment
+	const char *trace_path = getenv("PSEUDO_MALLOC_TRACE");
+	if (trace_path != NULL && trace_path[0] != '\0')
+	{
+		pseudo_trace_start(trace_path);
+	}
+	return 0;
+}
+
+// Destructor function to destroy buddy allocator. Other threads may outlive it, their caches and arenas are dropped
+// the next time they allocate or free, but none may be inside an allocator call while it runs.
+int destroy_buddy_allocator()
+{
+	// The trace ends with the memory it describes
+	if (__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+	{
+		pseudo_trace_stop();
+	}
+	// Blocks cached by the threads belong to the memory being unmapped
+	__atomic_add_fetch(&allocator_generation, 1, __ATOMIC_RELEASE);
+	large_cache_clear();
+	large_map_clear();
+	stats_reset();
+	// Unmap the reserved range of all the arenas
+	if (munmap(arena_space, (size_t)max_arenas << arena_shift) == -1)
+	{
+		return (-1);
+	}
+	// Clear the arenas, their bitmaps and free lists
+	for (int i = 0; i < arena_count; i++)
+	{
+		pthread_mutex_destroy(&arenas[i].lock);
+		munmap(arenas[i].bitmap, (bitmap_words + slab_map_words) * sizeof(uint64_t));
+	}
+	memset(arenas, 0, sizeof(arenas));
+	memset(cpu_arena, 0, sizeof(cpu_arena));
+	arena_count = 0;
+	assigned_arenas = 0;
+	arena_space = NULL;
+	return 0;
+}
+
+// Fork handler run before fork, takes every lock of the allocator so the child gets them in a consistent state
+void pseudo_fork_prepare()
+{
+	pthread_mutex_lock(&arenas_lock);
+	for (int i = 0; i < arena_count; i++)
+	{
+		pthread_mutex_lock(&arenas[i].lock);
+	}
+	pthread_mutex_lock(&large_cache_lock);
+	pthread_mutex_lock(&large_map_lock);
+	pthread_mutex_lock(&stats_lock);
+	pthread_mutex_lock(&trace_lock);
+}
+
+// Fork handler run in the parent after fork, releases the locks taken by pseudo_fork_prepare
+void pseudo_fork_parent()
+{
+	pthread_mutex_unlock(&trace_lock);
+	pthread_mutex_unlock(&stats_lock);
+	pthread_mutex_unlock(&large_map_lock);
+	pthread_mutex_unlock(&large_cache_lock);
+	for (int i = arena_count - 1; i >= 0; i--)
+	{
+		pthread_mutex_unlock(&arenas[i].lock);
+	}
+	pthread_mutex_unlock(&arenas_lock);
+}
+
+// Fork handler run in the child after fork. Only the forking thread exists there, so the locks are initialized
+// again instead of unlocked. Blocks cached by the other threads of the parent stay allocated in the child.
+void pseudo_fork_child()
+{
+	// The counters of the other threads are kept, their storage may be reused by the threads of the child
+	for (ThreadStats *stats = stats_threads, *next; stats != NULL; stats = next)
+	{
+		next = stats->next;
+		if (stats != &thread_stats)
+		{
+			stats_retire(stats);
+		}
+	}
+	pthread_mutex_init(&stats_lock, NULL);
+	// The trace belongs to the parent, the child does not add to it
+	__atomic_store_n(&trace_enabled, false, __ATOMIC_RELAXED);
+	if (trace_fd >= 0)
+	{
+		close(trace_fd);
+		trace_fd = -1;
+	}
+	for (TraceRing *ring = trace_rings; ring != NULL; ring = ring->next)
+	{
+		pthread_mutex_init(&ring->flush_lock, NULL);
+		ring->tail = ring->head;
+	}
+	pthread_mutex_init(&trace_lock, NULL);
+	pthread_mutex_init(&large_map_lock, NULL);
+	pthread_mutex_init(&large_cache_lock, NULL);
+	for (int i = 0; i < arena_count; i++)
+	{
+		pthread_mutex_init(&arenas[i].lock, NULL);
+	}
+	pthread_mutex_init(&arenas_lock, NULL);
 }
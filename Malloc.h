@@ -1,7 +1,15 @@
+#include <stdint.h>
+
 #define PAGE_SIZE 4096
-#define BUDDY_MEMORY_SIZE (1 << 20)     // 1 MB
-#define MIN_BLOCK_SIZE (PAGE_SIZE >> 4) // 1/16 of page size (256 bytes)
-#define MAX_LEVELS 16                   // 1 MB / 64 = 16384 blocks (2^14 blocks), log2(16384) = 14 + 1 for initial split
+#define BUDDY_MEMORY_SIZE (1 << 20)     // Default size of an arena, 1 MB
+#define MIN_BLOCK_SIZE (PAGE_SIZE >> 4) // Default smallest block, 1/16 of page size (256 bytes)
+#define SMALL_THRESHOLD (PAGE_SIZE / 4) // Default size from which requests go to large_alloc
+#define DECAY_TIME_MS 1000              // Default milliseconds a free arena block stays resident before it is purged
+#define MAX_LEVELS 32                   // Most orders of an arena, log2(arena size / smallest block) + 1
+#define STATS_SLAB_CLASSES 5            // Slab size classes counted by pseudo_malloc_stats, 8 << i bytes
+#define SLAB_CLASSES 5                  // Slab size classes of 8, 16, 32, 64 and 128 bytes
+#define SLAB_MIN_SHIFT 3                // log2 of the smallest slab size class
+#define SLAB_MAX_SIZE (1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
 
 typedef enum
 {
@@ -9,14 +17,161 @@ typedef enum
     true
 } bool;
 
+// Geometry of the buddy arenas, a field left at 0 keeps its default
+typedef struct BuddyConfig
+{
+    size_t arena_size;      // Bytes of an arena, a power of two
+    size_t min_block_size;  // Bytes of the smallest block, a power of two from 256 to PAGE_SIZE
+    size_t small_threshold; // Requests below it are served by the arenas, larger ones by mmap
+    size_t commit_size;     // Bytes of an arena committed when it is created, doubled each time it runs out
+    int max_arenas;         // Arenas reserved up front, at most 64
+} BuddyConfig;
+
+typedef struct LargeCacheStats
+{
+    size_t hits;
+    size_t misses;
+    size_t cached_bytes;
+    size_t resident_bytes;
+} LargeCacheStats;
+
+// Allocator counters added up over every thread since the allocator was initialized.
+// Reallocations in place count as a free and an allocation.
+typedef struct MallocStats
+{
+    size_t slab_allocs[STATS_SLAB_CLASSES]; // Slab objects of 8 << i bytes
+    size_t slab_frees[STATS_SLAB_CLASSES];
+    size_t buddy_allocs[MAX_LEVELS];        // Buddy blocks of order i, min_block_size << i bytes
+    size_t buddy_frees[MAX_LEVELS];
+    size_t arena_allocs;                    // Slab objects and buddy blocks together
+    size_t arena_frees;
+    size_t large_allocs;                    // Requests served by large_alloc, by size or because the arenas were full
+    size_t large_frees;
+    size_t splits;                          // Buddy blocks split in two
+    size_t coalesces;                       // Buddy blocks merged with their buddy
+    size_t requested_bytes;                 // Bytes asked for by every allocation
+    size_t granted_bytes;                   // Bytes of the blocks handed out for them
+    size_t bytes_in_use;                    // Bytes of the blocks not freed yet
+    size_t bytes_mapped;                    // Committed arena memory, arena metadata and large mappings, cached ones included
+    size_t peak_bytes_in_use;               // Most bytes in use at once, to within 64 KB per thread
+    size_t purged_bytes;                    // Bytes of free arena blocks given back to the kernel, by decay or pseudo_malloc_trim
+    double fragmentation;                   // Internal fragmentation, 1 - requested_bytes / granted_bytes
+} MallocStats;
+
+// Trace file written by pseudo_trace_start: a TraceHeader, then TraceRecords in the order each thread made its calls
+#define TRACE_MAGIC "PSTRACE1"
+#define TRACE_VERSION 1
+
+typedef struct TraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceHeader;
+
+typedef enum
+{
+    TRACE_MALLOC,   // ptr was allocated with size bytes
+    TRACE_FREE,     // ptr was freed
+    TRACE_REALLOC,  // aux was resized to size bytes and moved to ptr, size 0 frees it
+    TRACE_MEMALIGN, // ptr was allocated with size bytes aligned to aux
+} TraceOp;
+
+// Pointers are only ids that match the calls made on the same block
+typedef struct TraceRecord
+{
+    uint64_t time; // Nanoseconds since the trace started
+    uint64_t ptr;
+    uint64_t aux;
+    uint64_t info; // Size of the request and operation, see TRACE_INFO
+} TraceRecord;
+
+#define TRACE_INFO(size, op) (((uint64_t)(size) << 8) | (uint64_t)(op))
+#define TRACE_SIZE(info) ((info) >> 8)
+#define TRACE_OP(info) ((int)((info) & 0xFF))
+
+// Pool of equal objects, see pseudo_pool_create
+typedef struct PseudoPool PseudoPool;
+
+// Region of memory freed all at once, see pseudo_region_create
+typedef struct PseudoRegion PseudoRegion;
+
+// End of a region saved by pseudo_region_save
+typedef struct PseudoRegionMark
+{
+    void *chunk;
+    char *cursor;
+} PseudoRegionMark;
+
 void *pseudo_malloc(size_t size);
+void *pseudo_malloc_slab(int size_class, size_t size);
 int pseudo_free(void *ptr);
+int pseudo_free_sized(void *ptr, size_t size);
+size_t pseudo_malloc_bulk(size_t size, size_t count, void **ptrs);
+int pseudo_free_bulk(void **ptrs, size_t count);
+void *pseudo_realloc(void *ptr, size_t size);
+void *pseudo_memalign(size_t alignment, size_t size);
+void *pseudo_aligned_alloc(size_t alignment, size_t size);
+size_t pseudo_malloc_usable_size(void *ptr);
+bool pseudo_in_arena(const void *ptr);
+PseudoPool *pseudo_pool_create(size_t object_size, size_t alignment);
+void *pseudo_pool_alloc(PseudoPool *pool);
+void pseudo_pool_free(PseudoPool *pool, void *ptr);
+void pseudo_pool_destroy(PseudoPool *pool);
+PseudoRegion *pseudo_region_create(size_t initial_size);
+void *pseudo_region_alloc(PseudoRegion *region, size_t size);
+PseudoRegionMark pseudo_region_save(PseudoRegion *region);
+void pseudo_region_rollback(PseudoRegion *region, PseudoRegionMark mark);
+void pseudo_region_reset(PseudoRegion *region);
+void pseudo_region_destroy(PseudoRegion *region);
+void pseudo_flush_thread_cache();
+void pseudo_set_decay_time(size_t milliseconds);
+size_t pseudo_malloc_trim();
+void pseudo_set_large_cache_budget(size_t bytes);
+void pseudo_large_cache_stats(LargeCacheStats *stats);
+void pseudo_malloc_stats(MallocStats *stats);
+size_t pseudo_malloc_stats_json(char *buffer, size_t size);
+int pseudo_trace_start(const char *path);
+int pseudo_trace_stop();
+void pseudo_set_huge_pages(bool enabled);
+void pseudo_default_config(BuddyConfig *config);
 int init_buddy_allocator();
+int init_buddy_allocator_config(const BuddyConfig *config);
 int destroy_buddy_allocator();
+void pseudo_fork_prepare();
+void pseudo_fork_parent();
+void pseudo_fork_child();
 int print_buddy_allocator();
 int get_bitmap(int index);
 void set_bitmap(int index, int value);
 void clear_bitmap();
+int find_free_buddy(int index);
+int is_bitmap_full();
+
+// log2 of the smallest power of two holding size bytes
+static inline int pseudo_size_shift(size_t size)
+{
+    return size <= 1 ? 0 : (int)(sizeof(unsigned long) * 8) - __builtin_clzl((unsigned long)(size - 1));
+}
+
+// Slab size class of a request of 1 to SLAB_MAX_SIZE bytes, a constant when the size is one
+static inline int pseudo_slab_class(size_t size)
+{
+    int shift = pseudo_size_shift(size);
+    return shift > SLAB_MIN_SHIFT ? shift - SLAB_MIN_SHIFT : 0;
+}
+
+// Same as pseudo_malloc, inlined in the caller. A size up to SLAB_MAX_SIZE goes straight to the thread cache of its
+// slab class. A constant size, like sizeof of a node, picks its path and its class at compile time, so the call site
+// is a single call to pseudo_malloc_slab with the class as an immediate. A variable size costs a compare and a clz.
+static inline void *pseudo_malloc_inline(size_t size)
+{
+    if (__builtin_constant_p(size) ? size == 0 || size > SLAB_MAX_SIZE : size - 1 >= SLAB_MAX_SIZE)
+    {
+        return pseudo_malloc(size);
+    }
+    return pseudo_malloc_slab(pseudo_slab_class(size), size);
+}
 
 #ifdef DEBUG
 void print_bitmap();
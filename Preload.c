@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "Malloc.h"
+
+// Functions of this file replace the ones of libc, everything else of the library stays hidden
+#define PRELOAD_EXPORT __attribute__((visibility("default")))
+
+// Smallest block handed out, slab objects are aligned to their size so it keeps the 16 byte alignment of libc
+#define PRELOAD_MIN_SIZE 16
+
+// Initialization state of the allocator: not started, done, or failed
+enum
+{
+	PRELOAD_UNINITIALIZED,
+	PRELOAD_READY,
+	PRELOAD_FAILED
+};
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static int preload_state = PRELOAD_UNINITIALIZED;
+
+// Helper function to initialize the allocator, run once by the first thread that allocates.
+// init_buddy_allocator does not allocate, it only maps memory, so it cannot recurse into malloc.
+static void preload_init()
+{
+	int state = init_buddy_allocator() == 0 ? PRELOAD_READY : PRELOAD_FAILED;
+	__atomic_store_n(&preload_state, state, __ATOMIC_RELEASE);
+}
+
+// Helper function to make sure the allocator is initialized, false if it could not be
+static bool preload_ready()
+{
+	int state = __atomic_load_n(&preload_state, __ATOMIC_ACQUIRE);
+	if (state == PRELOAD_UNINITIALIZED)
+	{
+		pthread_once(&preload_once, preload_init);
+		state = __atomic_load_n(&preload_state, __ATOMIC_ACQUIRE);
+	}
+	if (state != PRELOAD_READY)
+	{
+		errno = ENOMEM;
+		return false;
+	}
+	return true;
+}
+
+// Constructor registering the fork handlers. It runs once libc is up, after any allocation made before it
+// initialized the allocator, so pthread_atfork may allocate without recursing into a half initialized allocator.
+__attribute__((constructor)) static void preload_register_fork_handlers()
+{
+	if (preload_ready())
+	{
+		pthread_atfork(pseudo_fork_prepare, pseudo_fork_parent, pseudo_fork_child);
+	}
+}
+
+// Destructor writing out the trace started by PSEUDO_MALLOC_TRACE, the threads still running never flush their rings
+__attribute__((destructor)) static void preload_stop_trace()
+{
+	pseudo_trace_stop();
+}
+
+// Helper function to allocate at least PRELOAD_MIN_SIZE bytes, malloc(0) returns a unique pointer too
+static void *preload_malloc(size_t size)
+{
+	if (!preload_ready())
+	{
+		return NULL;
+	}
+	return pseudo_malloc_inline(size < PRELOAD_MIN_SIZE ? PRELOAD_MIN_SIZE : size);
+}
+
+PRELOAD_EXPORT void *malloc(size_t size)
+{
+	return preload_malloc(size);
+}
+
+PRELOAD_EXPORT void free(void *ptr)
+{
+	// A pointer that is not NULL was allocated, so the allocator is already initialized
+	if (ptr != NULL)
+	{
+		// free leaves errno alone, pseudo_free and the madvise and munmap calls behind it may set it
+		int saved_errno = errno;
+		pseudo_free(ptr);
+		errno = saved_errno;
+	}
+}
+
+PRELOAD_EXPORT void *calloc(size_t count, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *ptr = preload_malloc(total);
+	if (ptr != NULL)
+	{
+		memset(ptr, 0, total);
+	}
+	return ptr;
+}
+
+PRELOAD_EXPORT void *realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+	{
+		return preload_malloc(size);
+	}
+	// A size of 0 frees the block and returns NULL, like the realloc of libc
+	return pseudo_realloc(ptr, size != 0 && size < PRELOAD_MIN_SIZE ? PRELOAD_MIN_SIZE : size);
+}
+
+// Helper function to allocate an aligned block, alignments below PRELOAD_MIN_SIZE are raised to it
+static void *preload_memalign(size_t alignment, size_t size)
+{
+	if (!preload_ready())
+	{
+		return NULL;
+	}
+	if (alignment < PRELOAD_MIN_SIZE)
+	{
+		alignment = PRELOAD_MIN_SIZE;
+	}
+	return pseudo_memalign(alignment, size == 0 ? 1 : size);
+}
+
+PRELOAD_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+	{
+		return EINVAL;
+	}
+	// posix_memalign reports errors through its result and leaves errno alone
+	int saved_errno = errno;
+	void *ptr = preload_memalign(alignment, size);
+	if (ptr == NULL)
+	{
+		int error = errno;
+		errno = saved_errno;
+		return error;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+PRELOAD_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	return preload_memalign(alignment, size);
+}
+
+// memalign, valloc and pvalloc are replaced as well, or their blocks would reach free from the libc allocator
+PRELOAD_EXPORT void *memalign(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	return preload_memalign(alignment, size);
+}
+
+PRELOAD_EXPORT void *valloc(size_t size)
+{
+	return preload_memalign(PAGE_SIZE, size);
+}
+
+PRELOAD_EXPORT void *pvalloc(size_t size)
+{
+	size_t rounded;
+	if (__builtin_add_overflow(size, PAGE_SIZE - 1, &rounded))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return preload_memalign(PAGE_SIZE, rounded & ~(size_t)(PAGE_SIZE - 1));
+}
+
+PRELOAD_EXPORT size_t malloc_usable_size(void *ptr)
+{
+	return pseudo_malloc_usable_size(ptr);
+}
+
+// The padding of glibc has no meaning here, every free page is given back. Returns 1 if memory was released.
+PRELOAD_EXPORT int malloc_trim(size_t pad)
+{
+	(void)pad;
+	if (__atomic_load_n(&preload_state, __ATOMIC_ACQUIRE) != PRELOAD_READY)
+	{
+		return 0;
+	}
+	return pseudo_malloc_trim() > 0;
+}
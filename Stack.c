@@ -1,49 +1,101 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <errno.h>
 
 #include "Stack.h"
 #include "Malloc.h"
 
 #define DEBUG
+#define CHUNK_MIN_ELEMENTS 16                                      // Elements of the first chunk
+#define CHUNK_MAX_ELEMENTS (SMALL_THRESHOLD / 2 / (int)sizeof(int)) // Chunks stop doubling here, so they stay buddy blocks
+#define CHUNK_DOUBLINGS __builtin_ctz(CHUNK_MAX_ELEMENTS / CHUNK_MIN_ELEMENTS)
+#define DIRECTORY_MIN_SLOTS 8                                      // Chunk pointers held by the first directory
+#define FREE_BATCH 256                                             // Nodes of the shared stack freed at once by its destroy
 
-typedef struct Node {
-    int data;
-    struct Node* next;
-} Node;
+_Static_assert((CHUNK_MAX_ELEMENTS & (CHUNK_MAX_ELEMENTS - 1)) == 0 && CHUNK_MAX_ELEMENTS >= CHUNK_MIN_ELEMENTS,
+               "Chunk sizes are powers of two that double from CHUNK_MIN_ELEMENTS to CHUNK_MAX_ELEMENTS");
+
+// The elements are stored bottom up in chunks of a power of two ints, so each chunk is exactly one block of the
+// allocator. Chunk k holds CHUNK_MIN_ELEMENTS << k elements until the size reaches CHUNK_MAX_ELEMENTS, then every
+// chunk has that size. The position of an element gives its chunk with a shift, so getElement is O(1).
+typedef struct ChunkedStack {
+    int** chunks;    // Chunk k holds the positions chunkOf maps to k
+    int chunkCount;  // Chunks allocated, at most one of them past the top is kept empty
+    int chunkSlots;  // Capacity of chunks
+    int size;        // Elements in the stack
+    PseudoPool* pool; // Pool of the chunks of CHUNK_MAX_ELEMENTS, NULL when they come from pseudo_malloc
+} ChunkedStack;
+
+// Helper function to get the number of elements of chunk k
+static int chunkCapacity(int k) {
+    return k < CHUNK_DOUBLINGS ? CHUNK_MIN_ELEMENTS << k : CHUNK_MAX_ELEMENTS;
+}
 
+// Helper function to find the chunk and the offset inside it of the element at a position from the bottom
+static int chunkOf(int position, int* offset) {
+    // The doubling chunks hold CHUNK_MIN_ELEMENTS * (2^k - 1) elements before chunk k
+    int doubling = CHUNK_MIN_ELEMENTS * ((1 << CHUNK_DOUBLINGS) - 1);
+    if (position >= doubling) {
+        *offset = (position - doubling) % CHUNK_MAX_ELEMENTS;
+        return CHUNK_DOUBLINGS + (position - doubling) / CHUNK_MAX_ELEMENTS;
+    }
+    int scaled = position / CHUNK_MIN_ELEMENTS + 1;
+    int k = 31 - __builtin_clz((unsigned int)scaled);
+    *offset = position - CHUNK_MIN_ELEMENTS * ((1 << k) - 1);
+    return k;
+}
 
 // Function to initialize the stack
 Stack initializeStack() {
-    Stack stack = pseudo_malloc(sizeof(Node *));
+    Stack stack = pseudo_malloc_inline(sizeof(ChunkedStack));
     if(stack == NULL){
         return NULL;
     }
-    *stack = NULL;
+    stack->chunks = NULL;
+    stack->chunkCount = 0;
+    stack->chunkSlots = 0;
+    stack->size = 0;
+    stack->pool = NULL;
     return stack;
 }
 
-// Function to free the memory allocated for the linked list
-int freeList(Node* head) {
-    struct Node* current = head;
-    struct Node* next;
+// Function to initialize a stack whose chunks of full size come from a pool of its own, they are
+// taken and given back without a size class lookup and all returned at once by destroyStack
+Stack initializePooledStack() {
+    Stack stack = initializeStack();
+    if(stack == NULL){
+        return NULL;
+    }
+    stack->pool = pseudo_pool_create(CHUNK_MAX_ELEMENTS * sizeof(int), sizeof(int));
+    if(stack->pool == NULL){
+        pseudo_free(stack);
+        return NULL;
+    }
+    return stack;
+}
 
-    // Traverse the linked list and free each node
-    while (current != NULL) {
-        next = current->next;
-        if(pseudo_free(current) ==-1){
-            printf("Corrente: %d\n", current->data);
-            return -1;
-        }
-        current = next;
+// Function to free the chunks of the stack, all at once
+int freeChunks(Stack stack) {
+    // Only the chunks that are still doubling come from pseudo_malloc when the stack has a pool
+    int allocated = stack->pool != NULL && stack->chunkCount > CHUNK_DOUBLINGS ? CHUNK_DOUBLINGS : stack->chunkCount;
+    if(allocated > 0 && pseudo_free_bulk((void**)stack->chunks, allocated) == -1){
+        return -1;
+    }
+    if(stack->pool != NULL){
+        pseudo_pool_destroy(stack->pool);
+    }
+    if(stack->chunks != NULL && pseudo_free(stack->chunks) == -1){
+        return -1;
     }
     return 1;
 }
 
 // Function to free the memory allocated for the stack
 int destroyStack(Stack stack) {
-    if(freeList(*stack) == -1){
-        printf("Error in freeList\n");
+    if(freeChunks(stack) == -1){
+        printf("Error in freeChunks\n");
         return -1;
     }
     if(pseudo_free(stack) == -1){
@@ -53,55 +105,209 @@ int destroyStack(Stack stack) {
     return 1;
 }
 
-// Function to add a new node at the beginning of the linked list
+// Helper function to add a chunk on top of the others, growing the directory when it is full
+static int addChunk(Stack stack) {
+    if (stack->chunkCount == stack->chunkSlots) {
+        int slots = stack->chunkSlots == 0 ? DIRECTORY_MIN_SLOTS : 2 * stack->chunkSlots;
+        int** chunks = pseudo_realloc(stack->chunks, slots * sizeof(int*));
+        if (chunks == NULL) {
+            return -1;
+        }
+        stack->chunks = chunks;
+        stack->chunkSlots = slots;
+    }
+    int capacity = chunkCapacity(stack->chunkCount);
+    int* chunk = stack->pool != NULL && capacity == CHUNK_MAX_ELEMENTS ? pseudo_pool_alloc(stack->pool)
+                                                                         : pseudo_malloc(capacity * sizeof(int));
+    if (chunk == NULL) {
+        return -1;
+    }
+    stack->chunks[stack->chunkCount++] = chunk;
+    return 0;
+}
+
+// Function to push an element on top of the stack, the allocator is called once per chunk
 int insert(Stack stack, int data) {
-    struct Node* newNode = (struct Node*)pseudo_malloc(sizeof(struct Node));
-    if(newNode == NULL){
+    int offset;
+    int k = chunkOf(stack->size, &offset);
+    if (k == stack->chunkCount && addChunk(stack) == -1) {
         errno = EINVAL;
         return -1;
     }
-    newNode->data = data;
-    newNode->next = *stack;
-    *stack = newNode;
+    stack->chunks[k][offset] = data;
+    stack->size++;
     return 0;
 }
 
-// Function to get the element at a specific index in the linked list
+// Function to get the element at a specific index, 0 being the top of the stack
 int getElement(Stack stack, int index) {
-    struct Node* current = *stack;
-    int count = 0;
-    while (current != NULL) {
-        if (count == index) {
-            return current->data;
-        }
-        current = current->next;
-        count++;
+    if (index < 0 || index >= stack->size) {
+        return -1;
     }
-    return -1;
+    int offset;
+    int k = chunkOf(stack->size - 1 - index, &offset);
+    return stack->chunks[k][offset];
 }
 
 #ifdef DEBUG
-// Function to print the elements of the linked list
+// Function to print the elements of the stack from the top
 void printStack(Stack stack) {
-    struct Node* current = *stack;
-    while (current != NULL) {
-        printf("%d ", current->data);
-        current = current->next;
+    for (int i = 0; i < stack->size; i++) {
+        printf("%d ", getElement(stack, i));
     }
     printf("\n");
 }
 #endif
 
-// Function to remove the first node from the linked list
+// Function to remove the top element of the stack
 int pop(Stack stack) {
-    if (*stack == NULL) {
+    if (stack->size == 0) {
         return -1;
     }
-    int data = (*stack)->data;
-    Node* temp = *stack;
-    *stack = (*stack)->next;
-    if(pseudo_free(temp)==-1) {
-        return -1;
+    int offset;
+    int k = chunkOf(--stack->size, &offset);
+    int data = stack->chunks[k][offset];
+    // The emptied chunk is kept for the next push, only the one above it is freed, so pushes and pops
+    // around a chunk boundary do not allocate and free the same chunk over and over
+    if (offset == 0 && stack->chunkCount > k + 1) {
+        int* chunk = stack->chunks[--stack->chunkCount];
+        if (stack->pool != NULL && chunkCapacity(stack->chunkCount) == CHUNK_MAX_ELEMENTS) {
+            pseudo_pool_free(stack->pool, chunk);
+        } else if(pseudo_free(chunk) == -1) {
+            return -1;
+        }
     }
     return data;
-}
\ No newline at end of file
+}
+
+// Node of the shared stack, allocated by each push and freed by each pop
+typedef struct SharedNode {
+    int data;
+    struct SharedNode* next;
+} SharedNode;
+
+// Top of the shared stack with a tag bumped by every change. A pop that read the top before other threads
+// popped it, freed it and pushed a node at the same address sees the tag changed, so its CAS fails (no ABA).
+typedef struct TaggedHead {
+    SharedNode* node;
+    uintptr_t tag;
+} __attribute__((aligned(2 * sizeof(void*)))) TaggedHead;
+
+typedef struct TreiberStack {
+    TaggedHead head;
+    SharedNode* retired; // Popped nodes outside the arenas, freed by destroySharedStack
+} TreiberStack;
+
+// Helper function to swap the head with a CAS on both words, cmpxchg16b on 64-bit and cmpxchg8b on 32-bit
+static bool headCompareExchange(TaggedHead* head, TaggedHead expected, TaggedHead desired) {
+#if __SIZEOF_POINTER__ == 8 && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+    // The __atomic builtins go through libatomic for 16 bytes, the __sync one is inlined with -mcx16
+    typedef unsigned __int128 Wide;
+    Wide old, new;
+    memcpy(&old, &expected, sizeof(old));
+    memcpy(&new, &desired, sizeof(new));
+    return __sync_bool_compare_and_swap((Wide*)head, old, new);
+#else
+    return __atomic_compare_exchange(head, &expected, &desired, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+#endif
+}
+
+// Helper function to read the head, the two words are read apart and a torn read only makes the next CAS fail
+static TaggedHead headLoad(TaggedHead* head) {
+    TaggedHead snapshot;
+    snapshot.tag = __atomic_load_n(&head->tag, __ATOMIC_ACQUIRE);
+    snapshot.node = __atomic_load_n(&head->node, __ATOMIC_ACQUIRE);
+    return snapshot;
+}
+
+// Function to initialize a stack that threads push and pop concurrently without a lock.
+// Its header is a slab object aligned to its size class of 4 words, so the head has the alignment the wide CAS needs.
+SharedStack initializeSharedStack() {
+    SharedStack stack = pseudo_malloc_inline(sizeof(TreiberStack));
+    if(stack == NULL){
+        return NULL;
+    }
+    stack->head.node = NULL;
+    stack->head.tag = 0;
+    stack->retired = NULL;
+    return stack;
+}
+
+// Helper function to free a list of nodes, a batch at a time
+static int freeNodes(SharedNode* current) {
+    void* batch[FREE_BATCH];
+    int count = 0;
+    while (current != NULL) {
+        batch[count++] = current;
+        current = current->next;
+        if (count == FREE_BATCH || current == NULL) {
+            if(pseudo_free_bulk(batch, count) == -1){
+                return -1;
+            }
+            count = 0;
+        }
+    }
+    return 0;
+}
+
+// Function to free the shared stack and its nodes, no other thread may use it anymore
+int destroySharedStack(SharedStack stack) {
+    if(freeNodes(stack->head.node) == -1 || freeNodes(stack->retired) == -1){
+        return -1;
+    }
+    if(pseudo_free(stack) == -1){
+        return -1;
+    }
+    return 1;
+}
+
+// Function to push an element on the shared stack
+int sharedInsert(SharedStack stack, int data) {
+    SharedNode* newNode = pseudo_malloc_inline(sizeof(SharedNode));
+    if(newNode == NULL){
+        errno = EINVAL;
+        return -1;
+    }
+    newNode->data = data;
+    TaggedHead new = {newNode, 0};
+    for (;;) {
+        TaggedHead old = headLoad(&stack->head);
+        // Atomic because a pop that read the head before this node was last popped may still read the field
+        __atomic_store_n(&newNode->next, old.node, __ATOMIC_RELAXED);
+        new.tag = old.tag + 1;
+        if (headCompareExchange(&stack->head, old, new)) {
+            return 0;
+        }
+    }
+}
+
+// Function to pop the top element of the shared stack, -1 if it is empty.
+// A node may be popped and freed by another thread while this one still reads its next field. The read stays
+// valid for nodes in the arenas, whose memory is never unmapped, and the tag makes the CAS that follows fail.
+// Once the arenas are full nodes come from large mappings that free may unmap, so those are never freed while
+// the stack is in use: they go on the retired list and destroySharedStack frees them.
+int sharedPop(SharedStack stack) {
+    for (;;) {
+        TaggedHead old = headLoad(&stack->head);
+        if (old.node == NULL) {
+            return -1;
+        }
+        TaggedHead new = {__atomic_load_n(&old.node->next, __ATOMIC_RELAXED), old.tag + 1};
+        if (headCompareExchange(&stack->head, old, new)) {
+            int data = old.node->data;
+            if (pseudo_in_arena(old.node)) {
+                if(pseudo_free(old.node) == -1){
+                    return -1;
+                }
+                return data;
+            }
+            // The retired list is only pushed to, so it needs no tag
+            SharedNode* retired = __atomic_load_n(&stack->retired, __ATOMIC_RELAXED);
+            do {
+                __atomic_store_n(&old.node->next, retired, __ATOMIC_RELAXED);
+            } while (!__atomic_compare_exchange_n(&stack->retired, &retired, old.node, true, __ATOMIC_RELEASE,
+                                                  __ATOMIC_RELAXED));
+            return data;
+        }
+    }
+}
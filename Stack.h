@@ -1,12 +1,22 @@
-typedef struct Node Node;
-typedef Node** Stack;
+typedef struct ChunkedStack ChunkedStack;
+typedef ChunkedStack* Stack;
 
 Stack initializeStack();
+Stack initializePooledStack();
 int destroyStack(Stack stack);
 int getElement(Stack stack, int index);
 int insert(Stack stack, int data);
 int pop(Stack stack);
 
+// Stack shared by threads, insert and pop are lock-free
+typedef struct TreiberStack TreiberStack;
+typedef TreiberStack* SharedStack;
+
+SharedStack initializeSharedStack();
+int destroySharedStack(SharedStack stack);
+int sharedInsert(SharedStack stack, int data);
+int sharedPop(SharedStack stack);
+
 #ifdef DEBUG
 void printStack(Stack stack);
 #endif
\ No newline at end of file
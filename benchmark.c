@@ -0,0 +1,773 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "Malloc.h"
+#include "Stack.h"
+
+#define BENCH_OPS 2000000    // Allocations and frees done by each thread
+#define BENCH_SLOTS 64       // Live blocks kept by each thread
+#define BENCH_MAX_SIZE 1000  // Largest request, everything goes through the small path
+#define HANDOFF_OPS 1000000  // Nodes passed from each producer to its consumer
+#define HANDOFF_LIMIT 4096   // Nodes a producer may have in flight before waiting for its consumer
+#define LARGE_OPS 200000     // Large buffers allocated and freed
+#define LARGE_SLOTS 16       // Large buffers kept alive at once
+#define SHARED_OPS 1000000   // Pushes and pops done by each thread on the shared stack
+
+// Node of the shared stack, laid out like ListNode
+typedef struct HandoffNode
+{
+    int data;
+    struct HandoffNode *next;
+} HandoffNode;
+
+// Stack shared by a producer that pushes and a consumer that pops
+typedef struct Handoff
+{
+    HandoffNode *head;
+    int in_flight;
+} Handoff;
+
+// Helper function to get the wall clock time in seconds
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *scaling_worker(void *arg)
+{
+    unsigned int seed = (unsigned int)(size_t)arg;
+    void *slots[BENCH_SLOTS] = {0};
+    for (int i = 0; i < BENCH_OPS; i++)
+    {
+        int slot = rand_r(&seed) % BENCH_SLOTS;
+        if (slots[slot] != NULL)
+        {
+            pseudo_free(slots[slot]);
+            slots[slot] = NULL;
+        }
+        else
+        {
+            slots[slot] = pseudo_malloc(1 + rand_r(&seed) % BENCH_MAX_SIZE);
+        }
+    }
+    for (int slot = 0; slot < BENCH_SLOTS; slot++)
+    {
+        if (slots[slot] != NULL)
+        {
+            pseudo_free(slots[slot]);
+        }
+    }
+    return NULL;
+}
+
+// Throughput of random small allocations and frees from 1 to max_threads threads
+void bench_thread_scaling(int max_threads)
+{
+    pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+    printf("Thread scaling (%d ops per thread)\n", BENCH_OPS);
+    printf("threads\tMops/s\tspeedup\n");
+    double base = 0;
+    for (int count = 1; count <= max_threads; count *= 2)
+    {
+        double start = now();
+        for (int i = 0; i < count; i++)
+        {
+            pthread_create(&threads[i], NULL, scaling_worker, (void *)(size_t)(i + 1));
+        }
+        for (int i = 0; i < count; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        double rate = (double)count * BENCH_OPS / (now() - start) / 1e6;
+        if (count == 1)
+        {
+            base = rate;
+        }
+        printf("%d\t%.2f\t%.2fx\n", count, rate, rate / base);
+    }
+    printf("\n");
+    free(threads);
+}
+
+void *handoff_producer(void *arg)
+{
+    Handoff *handoff = arg;
+    for (int i = 0; i < HANDOFF_OPS; i++)
+    {
+        while (__atomic_load_n(&handoff->in_flight, __ATOMIC_ACQUIRE) >= HANDOFF_LIMIT)
+        {
+            sched_yield();
+        }
+        HandoffNode *node = pseudo_malloc(sizeof(HandoffNode));
+        node->data = i;
+        // Push a node on the list, with a CAS since the consumer pops concurrently
+        node->next = __atomic_load_n(&handoff->head, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&handoff->head, &node->next, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+        __atomic_add_fetch(&handoff->in_flight, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void *handoff_consumer(void *arg)
+{
+    Handoff *handoff = arg;
+    int consumed = 0;
+    while (consumed < HANDOFF_OPS)
+    {
+        // Pop everything pushed so far and free it node by node
+        HandoffNode *node = __atomic_exchange_n(&handoff->head, NULL, __ATOMIC_ACQUIRE);
+        if (node == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+        int popped = 0;
+        while (node != NULL)
+        {
+            HandoffNode *next = node->next;
+            pseudo_free(node);
+            node = next;
+            popped++;
+        }
+        consumed += popped;
+        __atomic_sub_fetch(&handoff->in_flight, popped, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Throughput of nodes allocated by producer threads and freed by consumer threads
+void bench_producer_consumer(int max_threads)
+{
+    int max_pairs = max_threads / 2 > 0 ? max_threads / 2 : 1;
+    pthread_t *threads = malloc(2 * max_pairs * sizeof(pthread_t));
+    Handoff *handoffs = malloc(max_pairs * sizeof(Handoff));
+    printf("Producer/consumer (%d nodes per pair)\n", HANDOFF_OPS);
+    printf("pairs\tMops/s\n");
+    for (int pairs = 1; pairs <= max_pairs; pairs *= 2)
+    {
+        memset(handoffs, 0, pairs * sizeof(Handoff));
+        double start = now();
+        for (int i = 0; i < pairs; i++)
+        {
+            pthread_create(&threads[2 * i], NULL, handoff_producer, &handoffs[i]);
+            pthread_create(&threads[2 * i + 1], NULL, handoff_consumer, &handoffs[i]);
+        }
+        for (int i = 0; i < 2 * pairs; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        printf("%d\t%.2f\n", pairs, (double)pairs * HANDOFF_OPS / (now() - start) / 1e6);
+    }
+    printf("\n");
+    free(handoffs);
+    free(threads);
+}
+
+// Throughput of 4-64 KB buffers, the sizes served by large_alloc and its mapping cache
+void bench_large_buffers()
+{
+    unsigned int seed = 1;
+    void *slots[LARGE_SLOTS] = {0};
+    LargeCacheStats before, after;
+    pseudo_large_cache_stats(&before);
+    double start = now();
+    for (int i = 0; i < LARGE_OPS; i++)
+    {
+        int slot = rand_r(&seed) % LARGE_SLOTS;
+        if (slots[slot] != NULL)
+        {
+            pseudo_free(slots[slot]);
+        }
+        size_t size = 4096 + rand_r(&seed) % (60 * 1024);
+        slots[slot] = pseudo_malloc(size);
+        // Touch the buffer like a real user would, a fresh mapping pays its page faults here
+        memset(slots[slot], 0, size);
+    }
+    double elapsed = now() - start;
+    pseudo_large_cache_stats(&after);
+    for (int slot = 0; slot < LARGE_SLOTS; slot++)
+    {
+        if (slots[slot] != NULL)
+        {
+            pseudo_free(slots[slot]);
+        }
+    }
+    printf("Large buffers (%d ops of 4-64 KB)\n", LARGE_OPS);
+    printf("Kops/s\thits\tmisses\n");
+    printf("%.1f\t%zu\t%zu\n\n", LARGE_OPS / elapsed / 1e3, after.hits - before.hits, after.misses - before.misses);
+}
+
+#define HUGE_WORKING_SET (256 << 20)
+#define HUGE_ACCESSES 20000000
+
+// Random accesses over a buffer much larger than the TLB reach, where 2 MB pages avoid most page walks
+double random_access_rate(bool huge_pages)
+{
+    pseudo_set_huge_pages(huge_pages);
+    size_t words = HUGE_WORKING_SET / sizeof(size_t);
+    size_t *buffer = pseudo_malloc(HUGE_WORKING_SET);
+    pseudo_set_huge_pages(false);
+    if (buffer == NULL)
+    {
+        return 0;
+    }
+    memset(buffer, 1, HUGE_WORKING_SET);
+    size_t state = 2463534242u;
+    size_t sum = 0;
+    double start = now();
+    for (int i = 0; i < HUGE_ACCESSES; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        sum += buffer[state % words]++;
+    }
+    double elapsed = now() - start;
+    pseudo_free(buffer);
+    // Keep the loop from being optimized away
+    return sum != 0 ? HUGE_ACCESSES / elapsed : 0;
+}
+
+void bench_huge_pages()
+{
+    double normal = random_access_rate(false);
+    double huge = random_access_rate(true);
+    printf("Random access (%d MB working set)\n", HUGE_WORKING_SET >> 20);
+    printf("pages\tMaccesses/s\n");
+    printf("4 KB\t%.1f\n", normal / 1e6);
+    printf("2 MB\t%.1f\t(%.2fx)\n\n", huge / 1e6, normal > 0 ? huge / normal : 0);
+}
+
+#define VECTOR_SMALL_BYTES (16 << 10)
+#define VECTOR_SMALL_COUNT 20000
+#define VECTOR_LARGE_BYTES (64 << 20)
+
+// Append ints one by one to a vector whose capacity grows by a quarter, with pseudo_realloc or by hand
+double grow_vector(size_t max_bytes, bool use_realloc, long *reallocs, long *moves)
+{
+    size_t capacity = 16;
+    int *data = pseudo_malloc(capacity);
+    double start = now();
+    for (size_t count = 0; count * sizeof(int) < max_bytes; count++)
+    {
+        if ((count + 1) * sizeof(int) > capacity)
+        {
+            size_t new_capacity = capacity + capacity / 4;
+            int *new_data;
+            if (use_realloc)
+            {
+                new_data = pseudo_realloc(data, new_capacity);
+            }
+            else
+            {
+                new_data = pseudo_malloc(new_capacity);
+                memcpy(new_data, data, capacity);
+                pseudo_free(data);
+            }
+            (*reallocs)++;
+            if (new_data != data)
+            {
+                (*moves)++;
+            }
+            data = new_data;
+            capacity = new_capacity;
+        }
+        data[count] = (int)count;
+    }
+    double elapsed = now() - start;
+    pseudo_free(data);
+    return elapsed;
+}
+
+void bench_vector_growth()
+{
+    printf("Vector growth (%d vectors to %d KB, one to %d MB)\n", VECTOR_SMALL_COUNT, VECTOR_SMALL_BYTES >> 10, VECTOR_LARGE_BYTES >> 20);
+    printf("method\tsmall ms\tmoved\tlarge ms\tmoved\n");
+    for (int use_realloc = 0; use_realloc <= 1; use_realloc++)
+    {
+        long small_reallocs = 0, small_moves = 0, large_reallocs = 0, large_moves = 0;
+        double small = 0;
+        for (int i = 0; i < VECTOR_SMALL_COUNT; i++)
+        {
+            small += grow_vector(VECTOR_SMALL_BYTES, use_realloc, &small_reallocs, &small_moves);
+        }
+        double large = grow_vector(VECTOR_LARGE_BYTES, use_realloc, &large_reallocs, &large_moves);
+        printf("%s\t%.1f\t\t%ld/%ld\t%.1f\t\t%ld/%ld\n", use_realloc ? "realloc" : "copy", small * 1e3, small_moves, small_reallocs, large * 1e3, large_moves, large_reallocs);
+    }
+    printf("\n");
+}
+
+#define BULK_OBJECTS 1000000
+#define BULK_CHUNK 256
+
+void bench_bulk()
+{
+    void **ptrs = pseudo_malloc(BULK_OBJECTS * sizeof(void *));
+
+    double start = now();
+    for (int i = 0; i < BULK_OBJECTS; i++)
+    {
+        ptrs[i] = pseudo_malloc(16);
+    }
+    double single_alloc = now() - start;
+    start = now();
+    for (int i = 0; i < BULK_OBJECTS; i++)
+    {
+        pseudo_free(ptrs[i]);
+    }
+    double single_free = now() - start;
+
+    start = now();
+    for (int i = 0; i < BULK_OBJECTS; i += BULK_CHUNK)
+    {
+        pseudo_malloc_bulk(16, BULK_CHUNK, ptrs + i);
+    }
+    double bulk_alloc = now() - start;
+    start = now();
+    for (int i = 0; i < BULK_OBJECTS; i += BULK_CHUNK)
+    {
+        pseudo_free_bulk(ptrs + i, BULK_CHUNK);
+    }
+    double bulk_free = now() - start;
+    pseudo_free(ptrs);
+
+    printf("Bulk operations (%d objects of 16 bytes, ns per object)\n", BULK_OBJECTS);
+    printf("method\tmalloc\tfree\n");
+    printf("single\t%.1f\t%.1f\n", single_alloc * 1e9 / BULK_OBJECTS, single_free * 1e9 / BULK_OBJECTS);
+    printf("bulk\t%.1f\t%.1f\n\n", bulk_alloc * 1e9 / BULK_OBJECTS, bulk_free * 1e9 / BULK_OBJECTS);
+}
+
+#define STACK_ELEMENTS 1000000
+#define STACK_GETS 200 // Random indexes read, the list walks half of itself on average for each
+
+// Node of the linked list Stack.c used before it stored its elements in chunks, one allocation per element
+typedef struct ListNode
+{
+    int data;
+    struct ListNode *next;
+} ListNode;
+
+int list_get(ListNode *head, int index)
+{
+    for (int count = 0; head != NULL; head = head->next, count++)
+    {
+        if (count == index)
+        {
+            return head->data;
+        }
+    }
+    return -1;
+}
+
+// Helper function to free a list in batches, like the old destroyStack
+void list_destroy(ListNode *head)
+{
+    void *batch[BULK_CHUNK];
+    int count = 0;
+    while (head != NULL)
+    {
+        batch[count++] = head;
+        head = head->next;
+        if (count == BULK_CHUNK || head == NULL)
+        {
+            pseudo_free_bulk(batch, count);
+            count = 0;
+        }
+    }
+}
+
+void bench_stack()
+{
+    double push[2], get[2], pop_time[2], destroy[2];
+    unsigned int seed = 1;
+    int checksum = 0;
+
+    // The linked list: a node allocated by each push and freed by each pop
+    ListNode *head = NULL;
+    double start = now();
+    for (int i = 0; i < STACK_ELEMENTS; i++)
+    {
+        ListNode *node = pseudo_malloc(sizeof(ListNode));
+        node->data = i;
+        node->next = head;
+        head = node;
+    }
+    push[0] = now() - start;
+    start = now();
+    for (int i = 0; i < STACK_GETS; i++)
+    {
+        checksum += list_get(head, rand_r(&seed) % STACK_ELEMENTS);
+    }
+    get[0] = now() - start;
+    start = now();
+    for (int i = 0; i < STACK_ELEMENTS; i++)
+    {
+        ListNode *node = head;
+        checksum += node->data;
+        head = node->next;
+        pseudo_free(node);
+    }
+    pop_time[0] = now() - start;
+    for (int i = 0; i < STACK_ELEMENTS; i++)
+    {
+        ListNode *node = pseudo_malloc(sizeof(ListNode));
+        node->data = i;
+        node->next = head;
+        head = node;
+    }
+    start = now();
+    list_destroy(head);
+    destroy[0] = now() - start;
+
+    // The chunked stack of Stack.c
+    Stack stack = initializeStack();
+    start = now();
+    for (int i = 0; i < STACK_ELEMENTS; i++)
+    {
+        insert(stack, i);
+    }
+    push[1] = now() - start;
+    start = now();
+    for (int i = 0; i < STACK_GETS; i++)
+    {
+        checksum += getElement(stack, rand_r(&seed) % STACK_ELEMENTS);
+    }
+    get[1] = now() - start;
+    start = now();
+    for (int i = 0; i < STACK_ELEMENTS; i++)
+    {
+        checksum += pop(stack);
+    }
+    pop_time[1] = now() - start;
+    for (int i = 0; i < STACK_ELEMENTS; i++)
+    {
+        insert(stack, i);
+    }
+    start = now();
+    destroyStack(stack);
+    destroy[1] = now() - start;
+
+    printf("Stack (%d elements, ns per element, %d random gets)\n", STACK_ELEMENTS, STACK_GETS);
+    printf("stack\tpush\tget\t\tpop\tdestroy\n");
+    for (int i = 0; i < 2; i++)
+    {
+        printf("%s\t%.1f\t%.1f\t%.1f\t%.1f\n", i == 0 ? "list" : "chunked", push[i] * 1e9 / STACK_ELEMENTS, get[i] * 1e9 / STACK_GETS,
+               pop_time[i] * 1e9 / STACK_ELEMENTS, destroy[i] * 1e9 / STACK_ELEMENTS);
+    }
+    // The checksum keeps the reads from being optimized away
+    printf("(checksum %d)\n\n", checksum);
+}
+
+#define POOL_OBJECTS 1000000
+#define POOL_CHURN 64 // Live objects of the churn, each op frees the oldest and allocates a new one
+
+// Time of allocating POOL_OBJECTS list nodes, freeing them all, and churning through them, ns per op
+void bench_pool()
+{
+    void **ptrs = pseudo_malloc(POOL_OBJECTS * sizeof(void *));
+    double alloc[2], free_time[2], churn[2], destroy = 0;
+    for (int pooled = 0; pooled < 2; pooled++)
+    {
+        PseudoPool *pool = pooled ? pseudo_pool_create(sizeof(ListNode), 0) : NULL;
+        double start = now();
+        for (int i = 0; i < POOL_OBJECTS; i++)
+        {
+            ptrs[i] = pooled ? pseudo_pool_alloc(pool) : pseudo_malloc(sizeof(ListNode));
+        }
+        alloc[pooled] = now() - start;
+        start = now();
+        for (int i = 0; i < POOL_OBJECTS; i++)
+        {
+            if (pooled)
+            {
+                pseudo_pool_free(pool, ptrs[i]);
+            }
+            else
+            {
+                pseudo_free(ptrs[i]);
+            }
+        }
+        free_time[pooled] = now() - start;
+        for (int i = 0; i < POOL_CHURN; i++)
+        {
+            ptrs[i] = pooled ? pseudo_pool_alloc(pool) : pseudo_malloc(sizeof(ListNode));
+        }
+        start = now();
+        for (int i = 0; i < POOL_OBJECTS; i++)
+        {
+            int slot = i % POOL_CHURN;
+            if (pooled)
+            {
+                pseudo_pool_free(pool, ptrs[slot]);
+                ptrs[slot] = pseudo_pool_alloc(pool);
+            }
+            else
+            {
+                pseudo_free(ptrs[slot]);
+                ptrs[slot] = pseudo_malloc(sizeof(ListNode));
+            }
+        }
+        churn[pooled] = now() - start;
+        if (pooled)
+        {
+            // The objects still allocated go away with the pool
+            start = now();
+            pseudo_pool_destroy(pool);
+            destroy = now() - start;
+        }
+        else
+        {
+            for (int i = 0; i < POOL_CHURN; i++)
+            {
+                pseudo_free(ptrs[i]);
+            }
+        }
+    }
+    pseudo_free(ptrs);
+
+    printf("Object pool (%d objects of %zu bytes, ns per op)\n", POOL_OBJECTS, sizeof(ListNode));
+    printf("method\talloc\tfree\tchurn\n");
+    for (int pooled = 0; pooled < 2; pooled++)
+    {
+        printf("%s\t%.1f\t%.1f\t%.1f\n", pooled ? "pool" : "malloc", alloc[pooled] * 1e9 / POOL_OBJECTS, free_time[pooled] * 1e9 / POOL_OBJECTS,
+               churn[pooled] * 1e9 / POOL_OBJECTS);
+    }
+    printf("Pool destroyed with all its blocks in %.3f ms\n\n", destroy * 1e3);
+}
+
+#define REGION_REQUESTS 20000
+#define REGION_ALLOCS 100 // Allocations of 16 to 256 bytes made by each request, all freed when it ends
+
+// Time of request-scoped allocations freed one by one with pseudo_free or all at once by a region reset
+void bench_region()
+{
+    void *ptrs[REGION_ALLOCS];
+    double elapsed[2];
+    for (int use_region = 0; use_region < 2; use_region++)
+    {
+        unsigned int seed = 1;
+        PseudoRegion *region = use_region ? pseudo_region_create(0) : NULL;
+        double start = now();
+        for (int request = 0; request < REGION_REQUESTS; request++)
+        {
+            for (int i = 0; i < REGION_ALLOCS; i++)
+            {
+                size_t size = 16 + rand_r(&seed) % 241;
+                ptrs[i] = use_region ? pseudo_region_alloc(region, size) : pseudo_malloc(size);
+                // Touch the memory like a handler would
+                *(int *)ptrs[i] = i;
+            }
+            if (use_region)
+            {
+                pseudo_region_reset(region);
+                continue;
+            }
+            for (int i = 0; i < REGION_ALLOCS; i++)
+            {
+                pseudo_free(ptrs[i]);
+            }
+        }
+        elapsed[use_region] = now() - start;
+        if (use_region)
+        {
+            pseudo_region_destroy(region);
+        }
+    }
+    printf("Region (%d requests of %d allocations, ns per allocation and its free)\n", REGION_REQUESTS, REGION_ALLOCS);
+    printf("malloc\t%.1f\nregion\t%.1f\n\n", elapsed[0] * 1e9 / REGION_REQUESTS / REGION_ALLOCS,
+           elapsed[1] * 1e9 / REGION_REQUESTS / REGION_ALLOCS);
+}
+
+#define INLINE_ROUNDS 100000
+#define INLINE_BATCH 32 // Objects allocated then freed by each round, few enough to stay in the thread caches
+#define INLINE_TRIALS 5 // Runs of each method, the best one is reported
+
+// Helper function to allocate one object the way the inline benchmark asks: through pseudo_malloc or
+// pseudo_malloc_inline, with the constant size of a list node or a variable size of 1 to SLAB_MAX_SIZE bytes
+static inline void *inline_bench_alloc(int method, size_t size)
+{
+    switch (method)
+    {
+    case 0:
+        return pseudo_malloc(sizeof(ListNode));
+    case 1:
+        return pseudo_malloc_inline(sizeof(ListNode));
+    case 2:
+        return pseudo_malloc(size);
+    default:
+        return pseudo_malloc_inline(size);
+    }
+}
+
+// Time of small allocations served by the thread caches, through pseudo_malloc and through the inline fast path of
+// Malloc.h, ns per allocation. The frees are timed apart, they are the same for every method.
+void bench_inline()
+{
+    static const char *names[] = {"malloc const", "inline const", "malloc var", "inline var"};
+    void *ptrs[INLINE_BATCH];
+    // Variable sizes are drawn up front, so the loops time the allocator and not rand_r
+    unsigned char sizes[INLINE_BATCH];
+    unsigned int seed = 1;
+    for (int i = 0; i < INLINE_BATCH; i++)
+    {
+        sizes[i] = 1 + rand_r(&seed) % SLAB_MAX_SIZE;
+    }
+    double alloc[4] = {0};
+    // The methods take turns and each keeps its best trial, so a slow stretch of the machine does not favor one
+    for (int trial = 0; trial < INLINE_TRIALS; trial++)
+    {
+        for (int method = 0; method < 4; method++)
+        {
+            double elapsed = 0;
+            for (int round = 0; round < INLINE_ROUNDS; round++)
+            {
+                double start = now();
+                for (int i = 0; i < INLINE_BATCH; i++)
+                {
+                    ptrs[i] = inline_bench_alloc(method, sizes[i]);
+                }
+                elapsed += now() - start;
+                for (int i = 0; i < INLINE_BATCH; i++)
+                {
+                    pseudo_free(ptrs[i]);
+                }
+            }
+            alloc[method] = trial == 0 || elapsed < alloc[method] ? elapsed : alloc[method];
+        }
+    }
+
+    printf("Inline fast path (%d x %d objects of %zu bytes or 1 to %d bytes, best of %d, ns per allocation)\n",
+           INLINE_ROUNDS, INLINE_BATCH, sizeof(ListNode), SLAB_MAX_SIZE, INLINE_TRIALS);
+    for (int method = 0; method < 4; method++)
+    {
+        printf("%s\t%.1f\n", names[method], alloc[method] * 1e9 / INLINE_ROUNDS / INLINE_BATCH);
+    }
+    printf("\n");
+}
+
+// Stack pushed and popped by every thread, the lock-free SharedStack or a Stack behind a mutex
+typedef struct SharedBench
+{
+    SharedStack shared;
+    Stack locked;
+    pthread_mutex_t lock;
+} SharedBench;
+
+void *shared_stack_worker(void *arg)
+{
+    SharedBench *bench = arg;
+    // Pushes two for one pop until halfway, then pops two for one push, so the stack grows and shrinks again
+    for (int i = 0; i < SHARED_OPS; i++)
+    {
+        bool grow = i < SHARED_OPS / 2;
+        if (bench->shared != NULL)
+        {
+            sharedInsert(bench->shared, i);
+            sharedPop(bench->shared);
+            if (grow)
+            {
+                sharedInsert(bench->shared, i);
+            }
+            else
+            {
+                sharedPop(bench->shared);
+            }
+        }
+        else
+        {
+            pthread_mutex_lock(&bench->lock);
+            insert(bench->locked, i);
+            pop(bench->locked);
+            if (grow)
+            {
+                insert(bench->locked, i);
+            }
+            else
+            {
+                pop(bench->locked);
+            }
+            pthread_mutex_unlock(&bench->lock);
+        }
+    }
+    return NULL;
+}
+
+// Helper function to run the shared stack workload on count threads, returns the stack operations per second
+double run_shared_stack(SharedBench *bench, pthread_t *threads, int count)
+{
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        pthread_create(&threads[i], NULL, shared_stack_worker, bench);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    return 3.0 * count * SHARED_OPS / (now() - start);
+}
+
+// Throughput of one stack pushed and popped by 1 to max_threads threads. Each push of the lock-free stack
+// allocates a node and each pop frees one, often a node allocated by another thread.
+void bench_shared_stack(int max_threads)
+{
+    pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+    printf("Shared stack (%d x 3 ops per thread, Mops/s)\n", SHARED_OPS);
+    printf("threads\tlock-free\tmutex\n");
+    for (int count = 1; count <= max_threads; count *= 2)
+    {
+        SharedBench bench = {initializeSharedStack(), NULL, PTHREAD_MUTEX_INITIALIZER};
+        double lock_free = run_shared_stack(&bench, threads, count);
+        destroySharedStack(bench.shared);
+        bench.shared = NULL;
+        bench.locked = initializeStack();
+        double locked = run_shared_stack(&bench, threads, count);
+        destroyStack(bench.locked);
+        printf("%d\t%.2f\t\t%.2f\n", count, lock_free / 1e6, locked / 1e6);
+    }
+    printf("\n");
+    free(threads);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 1)
+    {
+        max_threads = 1;
+    }
+
+    if (init_buddy_allocator() == -1)
+    {
+        printf("Failed to initialize buddy allocator\n");
+        return -1;
+    }
+
+    bench_thread_scaling(max_threads);
+    bench_producer_consumer(max_threads);
+    bench_large_buffers();
+    bench_huge_pages();
+    bench_vector_growth();
+    bench_bulk();
+    bench_stack();
+    bench_pool();
+    bench_region();
+    bench_inline();
+    bench_shared_stack(max_threads);
+
+    if (destroy_buddy_allocator() == -1)
+    {
+        printf("Failed to destroy buddy allocator\n");
+        return -1;
+    }
+    return 0;
+}
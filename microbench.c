@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "Malloc.h"
+
+#define DEFAULT_OPS 1000000 // Allocations and frees done by each thread of a workload
+#define SLOTS 1024          // Live blocks a thread keeps in the churn, random and larson workloads
+#define SAMPLE_EVERY 8      // One operation in this many has its latency measured
+#define CHURN_SIZE 64       // Request of the fixed-size churn and of the producer/consumer nodes
+#define LARSON_ROUNDS 10    // Generations of threads in the larson workload, each one frees what the previous allocated
+#define QUEUE_LIMIT 4096    // Nodes a producer may have in flight before waiting for its consumer
+#define STACK_DEPTH 1000    // Nodes pushed before they are all popped in the stack workload
+
+// An allocator under test
+typedef struct Allocator
+{
+    const char *name;
+    int (*init)();
+    void *(*alloc)(size_t size);
+    void (*release)(void *ptr);
+} Allocator;
+
+// Node of the stack workload, a linked list node allocated per push
+typedef struct StackNode
+{
+    int data;
+    struct StackNode *next;
+} StackNode;
+
+// Queue shared by a producer that pushes and a consumer that pops
+typedef struct Queue
+{
+    StackNode *head;
+    int in_flight;
+} Queue;
+
+// State of one thread of a workload
+typedef struct Worker
+{
+    const Allocator *allocator;
+    long ops;
+    unsigned int seed;
+    // Blocks kept alive by the thread, handed from one generation to the next in the larson workload
+    void **slots;
+    // Queue of the producer/consumer pair, the even worker produces and the odd one consumes
+    Queue *queue;
+    bool producer;
+    // Operations done so far, and the latency in ticks of one in SAMPLE_EVERY of them
+    long done;
+    uint32_t *samples;
+    long sample_count;
+} Worker;
+
+typedef struct Workload
+{
+    const char *name;
+    void *(*run)(void *arg);
+    // Threads are started again for each round, the slots stay
+    int rounds;
+} Workload;
+
+// Result of one workload on one allocator, written by the child process that ran it
+typedef struct Result
+{
+    long ops;
+    double seconds;
+    double p50;
+    double p99;
+    double p999;
+    long max_rss_kb;
+} Result;
+
+static double ns_per_tick = 1.0;
+
+// Helper function to get the wall clock time in seconds
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Helper function to read the cheapest clock, the time stamp counter when there is one
+static inline uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Helper function to measure the length of a tick against clock_gettime
+void calibrate_ticks()
+{
+    double start = now();
+    uint64_t first = ticks();
+    while (now() - start < 0.05)
+    {
+    }
+    uint64_t last = ticks();
+    ns_per_tick = (now() - start) * 1e9 / (double)(last - first);
+}
+
+static int system_init()
+{
+    return 0;
+}
+
+static void *system_alloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void system_release(void *ptr)
+{
+    free(ptr);
+}
+
+static void *pseudo_alloc(size_t size)
+{
+    return pseudo_malloc(size);
+}
+
+static void pseudo_release(void *ptr)
+{
+    pseudo_free(ptr);
+}
+
+static const Allocator allocators[] = {
+    {"system", system_init, system_alloc, system_release},
+    {"pseudo", init_buddy_allocator, pseudo_alloc, pseudo_release},
+};
+
+// Helper function to allocate through the allocator under test, timing one call in SAMPLE_EVERY
+static inline void *bench_alloc(Worker *worker, size_t size)
+{
+    void *ptr;
+    if (++worker->done % SAMPLE_EVERY != 0)
+    {
+        ptr = worker->allocator->alloc(size);
+    }
+    else
+    {
+        uint64_t start = ticks();
+        ptr = worker->allocator->alloc(size);
+        worker->samples[worker->sample_count++] = (uint32_t)(ticks() - start);
+    }
+    // Touch the block like a real user would
+    *(char *)ptr = 1;
+    return ptr;
+}
+
+// Helper function to free through the allocator under test, timing one call in SAMPLE_EVERY
+static inline void bench_free(Worker *worker, void *ptr)
+{
+    if (++worker->done % SAMPLE_EVERY != 0)
+    {
+        worker->allocator->release(ptr);
+    }
+    else
+    {
+        uint64_t start = ticks();
+        worker->allocator->release(ptr);
+        worker->samples[worker->sample_count++] = (uint32_t)(ticks() - start);
+    }
+}
+
+// Fixed-size churn: every new block replaces the oldest one of a ring
+void *churn_worker(void *arg)
+{
+    Worker *worker = arg;
+    for (long i = 0; worker->done < worker->ops; i++)
+    {
+        void **slot = &worker->slots[i % SLOTS];
+        if (*slot != NULL)
+        {
+            bench_free(worker, *slot);
+        }
+        *slot = bench_alloc(worker, CHURN_SIZE);
+    }
+    return NULL;
+}
+
+// Helper function to draw a size from 8 bytes to 8 KB, spread evenly over the powers of two
+static size_t random_size(unsigned int *seed, int max_shift)
+{
+    int shift = 3 + rand_r(seed) % (max_shift - 2);
+    return ((size_t)1 << shift) + (size_t)rand_r(seed) % ((size_t)1 << shift);
+}
+
+// Random sizes: a random block is replaced by one of a random size
+void *random_worker(void *arg)
+{
+    Worker *worker = arg;
+    while (worker->done < worker->ops)
+    {
+        void **slot = &worker->slots[rand_r(&worker->seed) % SLOTS];
+        if (*slot != NULL)
+        {
+            bench_free(worker, *slot);
+        }
+        *slot = bench_alloc(worker, random_size(&worker->seed, 12));
+    }
+    return NULL;
+}
+
+// Larson: like random sizes up to 1 KB, but each round is done by a new thread that inherits the blocks of the previous
+// one, so most frees are of blocks allocated by a thread that exited
+void *larson_worker(void *arg)
+{
+    Worker *worker = arg;
+    long round_end = worker->done + worker->ops / LARSON_ROUNDS;
+    while (worker->done < round_end)
+    {
+        void **slot = &worker->slots[rand_r(&worker->seed) % SLOTS];
+        if (*slot != NULL)
+        {
+            bench_free(worker, *slot);
+        }
+        *slot = bench_alloc(worker, random_size(&worker->seed, 9));
+    }
+    return NULL;
+}
+
+// Producer/consumer: nodes allocated by one thread are freed by another
+void *queue_worker(void *arg)
+{
+    Worker *worker = arg;
+    Queue *queue = worker->queue;
+    if (worker->producer)
+    {
+        while (worker->done < worker->ops)
+        {
+            while (__atomic_load_n(&queue->in_flight, __ATOMIC_ACQUIRE) >= QUEUE_LIMIT)
+            {
+                sched_yield();
+            }
+            StackNode *node = bench_alloc(worker, CHURN_SIZE);
+            node->next = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&queue->head, &node->next, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            {
+            }
+            __atomic_add_fetch(&queue->in_flight, 1, __ATOMIC_RELEASE);
+        }
+        return NULL;
+    }
+    while (worker->done < worker->ops)
+    {
+        StackNode *node = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+        if (node == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+        int popped = 0;
+        while (node != NULL)
+        {
+            StackNode *next = node->next;
+            bench_free(worker, node);
+            node = next;
+            popped++;
+        }
+        __atomic_sub_fetch(&queue->in_flight, popped, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Stack push/pop: STACK_DEPTH nodes are pushed on a linked list, then all popped and freed
+void *stack_worker(void *arg)
+{
+    Worker *worker = arg;
+    StackNode *head = NULL;
+    while (worker->done < worker->ops)
+    {
+        for (int i = 0; i < STACK_DEPTH; i++)
+        {
+            StackNode *node = bench_alloc(worker, sizeof(StackNode));
+            node->data = i;
+            node->next = head;
+            head = node;
+        }
+        while (head != NULL)
+        {
+            StackNode *next = head->next;
+            bench_free(worker, head);
+            head = next;
+        }
+    }
+    return NULL;
+}
+
+static const Workload workloads[] = {
+    {"churn", churn_worker, 1},
+    {"random", random_worker, 1},
+    {"prodcons", queue_worker, 1},
+    {"larson", larson_worker, LARSON_ROUNDS},
+    {"stack", stack_worker, 1},
+};
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Helper function to get memory that does not come from the allocator under test
+static void *map_memory(size_t size)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Helper function to run a workload in the calling process, fills everything but max_rss_kb
+static int run_workload(const Workload *workload, const Allocator *allocator, int threads, long ops, Result *result)
+{
+    if (allocator->init() == -1)
+    {
+        return -1;
+    }
+    // The bookkeeping of the benchmark is mapped directly, so only the workload goes through the allocator
+    long capacity = ops / SAMPLE_EVERY + 2 * STACK_DEPTH;
+    Worker *workers = map_memory(threads * sizeof(Worker));
+    pthread_t *ids = map_memory(threads * sizeof(pthread_t));
+    Queue *queues = map_memory(threads * sizeof(Queue));
+    uint32_t *samples = map_memory(threads * capacity * sizeof(uint32_t));
+    void **slots = map_memory(threads * SLOTS * sizeof(void *));
+    if (workers == NULL || ids == NULL || queues == NULL || samples == NULL || slots == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].allocator = allocator;
+        workers[i].ops = ops;
+        workers[i].seed = (unsigned int)i + 1;
+        workers[i].slots = slots + i * SLOTS;
+        workers[i].queue = &queues[i / 2];
+        workers[i].producer = i % 2 == 0;
+        workers[i].samples = samples + i * capacity;
+    }
+
+    double start = now();
+    for (int round = 0; round < workload->rounds; round++)
+    {
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_create(&ids[i], NULL, workload->run, &workers[i]);
+        }
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_join(ids[i], NULL);
+        }
+    }
+    result->seconds = now() - start;
+
+    // Gather the samples of every thread in one sorted run
+    long count = 0;
+    result->ops = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        memmove(samples + count, workers[i].samples, workers[i].sample_count * sizeof(uint32_t));
+        count += workers[i].sample_count;
+        result->ops += workers[i].done;
+    }
+    qsort(samples, count, sizeof(uint32_t), compare_samples);
+    result->p50 = count > 0 ? samples[count / 2] * ns_per_tick : 0;
+    result->p99 = count > 0 ? samples[count * 99 / 100] * ns_per_tick : 0;
+    result->p999 = count > 0 ? samples[count * 999 / 1000] * ns_per_tick : 0;
+    return 0;
+}
+
+// Helper function to run a workload in a child process of its own, so each allocator starts from a fresh heap
+// and the peak RSS reported by the kernel belongs to that run alone
+int run_case(const Workload *workload, const Allocator *allocator, int threads, long ops, Result *result)
+{
+    Result *shared = mmap(NULL, sizeof(Result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        _exit(run_workload(workload, allocator, threads, ops, shared) == 0 ? 0 : 1);
+    }
+    int status = 0;
+    struct rusage usage;
+    int ret = -1;
+    if (pid > 0 && wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        *result = *shared;
+        result->max_rss_kb = usage.ru_maxrss;
+        ret = 0;
+    }
+    munmap(shared, sizeof(Result));
+    return ret;
+}
+
+void print_usage(const char *program)
+{
+    printf("Usage: %s [--json] [--threads N] [--ops N] [workload...]\n", program);
+    printf("Workloads:");
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        printf(" %s", workloads[i].name);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long ops = DEFAULT_OPS;
+    const char *selected[sizeof(workloads) / sizeof(workloads[0])];
+    int selected_count = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+        {
+            ops = atol(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && selected_count < (int)(sizeof(selected) / sizeof(selected[0])))
+        {
+            selected[selected_count++] = argv[i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    threads = threads < 1 ? 1 : threads;
+    ops = ops < STACK_DEPTH ? STACK_DEPTH : ops;
+    calibrate_ticks();
+
+    if (!json)
+    {
+        printf("%d threads, %ld ops per thread, latency of 1 op in %d\n", threads, ops, SAMPLE_EVERY);
+        printf("workload\tallocator\tMops/s\tp50 ns\tp99 ns\tp999 ns\tmaxrss KB\tvs system\n");
+    }
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        const Workload *workload = &workloads[w];
+        bool wanted = selected_count == 0;
+        for (int i = 0; i < selected_count; i++)
+        {
+            wanted = wanted || strcmp(selected[i], workload->name) == 0;
+        }
+        if (!wanted)
+        {
+            continue;
+        }
+        // Producers and consumers come in pairs
+        int workload_threads = workload->run == queue_worker ? (threads + 1) / 2 * 2 : threads;
+        double system_rate = 0;
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+        {
+            Result result;
+            if (run_case(workload, &allocators[a], workload_threads, ops, &result) == -1)
+            {
+                fprintf(stderr, "%s on %s failed\n", workload->name, allocators[a].name);
+                continue;
+            }
+            double rate = result.ops / result.seconds;
+            system_rate = a == 0 ? rate : system_rate;
+            if (json)
+            {
+                printf("{\"workload\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, \"ops\": %ld, \"seconds\": %.6f, "
+                       "\"ops_per_sec\": %.0f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f, \"max_rss_kb\": %ld}\n",
+                       workload->name, allocators[a].name, workload_threads, result.ops, result.seconds, rate,
+                       result.p50, result.p99, result.p999, result.max_rss_kb);
+            }
+            else
+            {
+                printf("%s\t%s\t\t%.2f\t%.0f\t%.0f\t%.0f\t%ld\t\t%.2fx\n", workload->name, allocators[a].name, rate / 1e6,
+                       result.p50, result.p99, result.p999, result.max_rss_kb, system_rate > 0 ? rate / system_rate : 0);
+            }
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
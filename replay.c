@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "Malloc.h"
+
+// A block of the trace and the block that stands for it in the replay
+typedef struct Replayed
+{
+    uint64_t id;
+    void *ptr;
+    size_t size;
+} Replayed;
+
+// Open addressing table of the live blocks, keyed by trace id, mapped directly so it does not weigh on the allocator
+typedef struct ReplayMap
+{
+    Replayed *slots;
+    size_t mask;
+} ReplayMap;
+
+typedef struct ReplayResult
+{
+    long ops;
+    long unmatched;
+    double seconds;
+    size_t peak_requested;
+    long rss_growth_kb;
+} ReplayResult;
+
+// Helper function to get the wall clock time in seconds
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Helper function to get the peak resident memory of the process in KB
+long max_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Helper function to get the slot of an id, or the empty slot where it would go
+Replayed *replay_slot(ReplayMap *map, uint64_t id)
+{
+    size_t slot = (size_t)((id >> 4) * 0x9E3779B97F4A7C15ULL) & map->mask;
+    while (map->slots[slot].id != 0 && map->slots[slot].id != id)
+    {
+        slot = (slot + 1) & map->mask;
+    }
+    return &map->slots[slot];
+}
+
+// Helper function to forget an id, the following entries of its probe chain are shifted back
+void replay_remove(ReplayMap *map, Replayed *entry)
+{
+    size_t hole = (size_t)(entry - map->slots);
+    for (size_t next = (hole + 1) & map->mask; map->slots[next].id != 0; next = (next + 1) & map->mask)
+    {
+        size_t home = (size_t)((map->slots[next].id >> 4) * 0x9E3779B97F4A7C15ULL) & map->mask;
+        if (((next - home) & map->mask) >= ((next - hole) & map->mask))
+        {
+            map->slots[hole] = map->slots[next];
+            hole = next;
+        }
+    }
+    map->slots[hole].id = 0;
+}
+
+// Allocations sort before frees made at the same time, a block is always allocated before another thread frees it
+static int compare_records(const void *a, const void *b)
+{
+    const TraceRecord *x = a;
+    const TraceRecord *y = b;
+    if (x->time != y->time)
+    {
+        return x->time < y->time ? -1 : 1;
+    }
+    return (TRACE_OP(x->info) == TRACE_FREE) - (TRACE_OP(y->info) == TRACE_FREE);
+}
+
+// Helper function to replay the calls of a trace in time order with the system allocator or pseudo_malloc
+int replay(TraceRecord *records, size_t count, bool use_system, ReplayResult *result)
+{
+    ReplayMap map;
+    size_t slots = 16;
+    while (slots < 2 * count)
+    {
+        slots *= 2;
+    }
+    map.slots = mmap(NULL, slots * sizeof(Replayed), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map.slots == MAP_FAILED)
+    {
+        return -1;
+    }
+    map.mask = slots - 1;
+    // Fault the table in now, so the growth of the resident memory is the allocator's alone
+    memset(map.slots, 0, slots * sizeof(Replayed));
+
+    memset(result, 0, sizeof(*result));
+    long rss_before = max_rss_kb();
+    size_t requested = 0;
+    double start = now();
+    for (size_t i = 0; i < count; i++)
+    {
+        TraceRecord *record = &records[i];
+        int op = TRACE_OP(record->info);
+        size_t size = TRACE_SIZE(record->info);
+        // The block given to free or realloc, NULL when the trace never allocated it
+        Replayed *old = NULL;
+        uint64_t old_id = op == TRACE_FREE ? record->ptr : op == TRACE_REALLOC ? record->aux : 0;
+        if (old_id != 0)
+        {
+            old = replay_slot(&map, old_id);
+            if (old->id == 0)
+            {
+                result->unmatched++;
+                continue;
+            }
+        }
+        void *ptr = NULL;
+        if (op == TRACE_MALLOC)
+        {
+            ptr = use_system ? malloc(size) : pseudo_malloc(size);
+        }
+        else if (op == TRACE_MEMALIGN && use_system)
+        {
+            // posix_memalign wants at least the alignment of a pointer
+            size_t alignment = record->aux < sizeof(void *) ? sizeof(void *) : record->aux;
+            if (posix_memalign(&ptr, alignment, size) != 0)
+            {
+                ptr = NULL;
+            }
+        }
+        else if (op == TRACE_MEMALIGN)
+        {
+            ptr = pseudo_memalign(record->aux, size);
+        }
+        else if (op == TRACE_REALLOC)
+        {
+            void *old_ptr = old != NULL ? old->ptr : NULL;
+            ptr = use_system ? realloc(old_ptr, size) : pseudo_realloc(old_ptr, size);
+            if (ptr == NULL && size != 0)
+            {
+                result->unmatched++;
+                continue;
+            }
+        }
+        else if (op == TRACE_FREE)
+        {
+            if (use_system)
+            {
+                free(old->ptr);
+            }
+            else
+            {
+                pseudo_free(old->ptr);
+            }
+        }
+        if (old != NULL)
+        {
+            requested -= old->size;
+            replay_remove(&map, old);
+        }
+        if (ptr != NULL && record->ptr != 0)
+        {
+            // Write the block like the traced program did, so its pages count in the resident memory
+            memset(ptr, 0, size);
+            Replayed *entry = replay_slot(&map, record->ptr);
+            if (entry->id != 0)
+            {
+                // The trace allocated the id again without freeing it, the old block was lost
+                requested -= entry->size;
+            }
+            entry->id = record->ptr;
+            entry->ptr = ptr;
+            entry->size = size;
+            requested += size;
+            result->peak_requested = requested > result->peak_requested ? requested : result->peak_requested;
+        }
+        result->ops++;
+    }
+    result->seconds = now() - start;
+    result->rss_growth_kb = max_rss_kb() - rss_before;
+    munmap(map.slots, slots * sizeof(Replayed));
+    return 0;
+}
+
+// Helper function to map a trace file and check its header, returns its records
+TraceRecord *load_trace(const char *path, size_t *count)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(TraceHeader))
+    {
+        return NULL;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+    TraceHeader *header = (TraceHeader *)data;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != TRACE_VERSION ||
+        header->record_size != sizeof(TraceRecord))
+    {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    *count = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    TraceRecord *records = (TraceRecord *)(data + sizeof(TraceHeader));
+    // Each thread wrote its records in order, merge them into one timeline
+    qsort(records, *count, sizeof(TraceRecord), compare_records);
+    return records;
+}
+
+int main(int argc, char *argv[])
+{
+    bool use_system = false;
+    bool json = false;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--system") == 0)
+        {
+            use_system = true;
+        }
+        else if (strcmp(argv[i], "--json") == 0)
+        {
+            json = true;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+    if (path == NULL)
+    {
+        printf("Usage: %s [--system] [--json] trace_file\n", argv[0]);
+        return -1;
+    }
+    size_t count = 0;
+    TraceRecord *records = load_trace(path, &count);
+    if (records == NULL)
+    {
+        printf("Failed to load trace %s\n", path);
+        return -1;
+    }
+    if (!use_system && init_buddy_allocator() == -1)
+    {
+        printf("Failed to initialize buddy allocator\n");
+        return -1;
+    }
+
+    ReplayResult result;
+    if (replay(records, count, use_system, &result) == -1)
+    {
+        printf("Failed to replay trace %s\n", path);
+        return -1;
+    }
+    // External fragmentation: the share of the memory the replay made resident that no live request needed at the peak
+    size_t rss_growth = (size_t)result.rss_growth_kb * 1024;
+    double fragmentation = rss_growth > result.peak_requested ? 1.0 - (double)result.peak_requested / (double)rss_growth : 0.0;
+    MallocStats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (!use_system)
+    {
+        pseudo_malloc_stats(&stats);
+    }
+    const char *allocator = use_system ? "system" : "pseudo";
+    if (json)
+    {
+        printf("{\"allocator\": \"%s\", \"records\": %zu, \"ops\": %ld, \"unmatched\": %ld, \"seconds\": %.6f, "
+               "\"peak_requested_bytes\": %zu, \"rss_growth_kb\": %ld, \"fragmentation\": %.4f",
+               allocator, count, result.ops, result.unmatched, result.seconds, result.peak_requested, result.rss_growth_kb,
+               fragmentation);
+        if (!use_system)
+        {
+            printf(", \"peak_bytes_in_use\": %zu, \"bytes_mapped\": %zu, \"internal_fragmentation\": %.4f",
+                   stats.peak_bytes_in_use, stats.bytes_mapped, stats.fragmentation);
+        }
+        printf("}\n");
+    }
+    else
+    {
+        printf("Replayed %ld of %zu calls with the %s allocator in %.3f s (%.2f Mops/s), %ld did not match the trace\n",
+               result.ops, count, allocator, result.seconds, result.ops / result.seconds / 1e6, result.unmatched);
+        printf("Peak requested: %zu KB, resident growth: %ld KB, fragmentation: %.1f%%\n", result.peak_requested / 1024,
+               result.rss_growth_kb, fragmentation * 100);
+        if (!use_system)
+        {
+            printf("Allocator peak in use: %zu KB, mapped: %zu KB, internal fragmentation: %.1f%%\n",
+                   stats.peak_bytes_in_use / 1024, stats.bytes_mapped / 1024, stats.fragmentation * 100);
+        }
+    }
+    return 0;
+}
@@ -4,6 +4,8 @@
 #include <time.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
 
 #include "Malloc.h"
 #include "Stack.h"
@@ -112,7 +114,7 @@ void test_write_and_read()
     {
         passed = false;
     }
-    printTest(strcmp(read_string1, test_string1) == 0 && strcmp(read_string2, test_string2) == 0, "Write and read");
+    printTest(passed, "Write and read");
 }
 
 void test_small_allocation_fill()
@@ -324,7 +326,7 @@ void test_overlapping_allocations()
     bool passed = true;
     void *ptr1 = pseudo_malloc(100);
     void *ptr2 = pseudo_malloc(100);
-    passed = ptr1 != NULL && ptr2 != NULL && ptr1 + 100 <= ptr2;
+    passed = ptr1 != NULL && ptr2 != NULL && (ptr1 + 100 <= ptr2 || ptr2 + 100 <= ptr1);
     if (pseudo_free(ptr1) == -1 || pseudo_free(ptr2) == -1)
     {
         passed = false;
@@ -416,6 +418,1480 @@ void test_edge_case_exact_page()
     printTest(passed, "Edge case exact page");
 }
 
+void test_buddy_blocks_do_not_alias()
+{
+    bool passed = true;
+    unsigned char *ptrs[BUDDY_MEMORY_SIZE / MIN_BLOCK_SIZE];
+    int count = BUDDY_MEMORY_SIZE / MIN_BLOCK_SIZE;
+    for (int i = 0; i < count; i++)
+    {
+        ptrs[i] = pseudo_malloc(MIN_BLOCK_SIZE);
+        if (ptrs[i] == NULL)
+        {
+            passed = false;
+            count = i;
+            break;
+        }
+        memset(ptrs[i], i & 0xFF, MIN_BLOCK_SIZE);
+    }
+    for (int i = 0; i < count && passed; i++)
+    {
+        for (int j = 0; j < MIN_BLOCK_SIZE; j++)
+        {
+            if (ptrs[i][j] != (i & 0xFF))
+            {
+                passed = false;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (pseudo_free(ptrs[i]) == -1)
+        {
+            passed = false;
+        }
+    }
+    printTest(passed, "Buddy blocks do not alias");
+}
+
+void test_buddy_coalesce()
+{
+    bool passed = true;
+    void *small[4];
+    for (int i = 0; i < 4; i++)
+    {
+        small[i] = pseudo_malloc(MIN_BLOCK_SIZE);
+        if (small[i] == NULL)
+        {
+            passed = false;
+        }
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (pseudo_free(small[i]) == -1)
+        {
+            passed = false;
+        }
+    }
+    // Once the thread cache is released every block merges back into the whole buddy memory
+    pseudo_flush_thread_cache();
+    passed = passed && find_free_buddy(0) == 0;
+    void *big = pseudo_malloc(4 * MIN_BLOCK_SIZE - 1);
+    if (pseudo_free(big) == -1 || pseudo_free(big) != -1)
+    {
+        passed = false;
+    }
+    printTest(passed, "Buddy coalesce and double free");
+}
+
+void test_buddy_double_free_of_half()
+{
+    // Blocks of a quarter arena are not cached by the threads, so free reaches the tree directly
+    BuddyConfig config = {0};
+    config.arena_size = BUDDY_MEMORY_SIZE;
+    config.small_threshold = BUDDY_MEMORY_SIZE / 2;
+    config.max_arenas = 1;
+    destroy_buddy_allocator();
+    bool passed = init_buddy_allocator_config(&config) == 0;
+    unsigned char *a = pseudo_malloc(BUDDY_MEMORY_SIZE / 4);
+    unsigned char *b = pseudo_malloc(BUDDY_MEMORY_SIZE / 4);
+    passed = passed && a != NULL && b == a + BUDDY_MEMORY_SIZE / 4;
+    // Once a is free its parent is still split because of b, freeing a again must not free the parent
+    passed = passed && pseudo_free(a) != -1 && pseudo_free(a) == -1;
+    passed = passed && pseudo_free_sized(a, BUDDY_MEMORY_SIZE / 2) == -1;
+    // The parent is still split so a block of half the arena cannot overlap b
+    unsigned char *half = pseudo_malloc(BUDDY_MEMORY_SIZE / 2);
+    passed = passed && half != NULL && (half + BUDDY_MEMORY_SIZE / 2 <= b || half >= b + BUDDY_MEMORY_SIZE / 4);
+    passed = passed && pseudo_free(half) != -1 && pseudo_free(b) != -1;
+    // Every node is clear again, the arena merged back into one block
+    passed = passed && find_free_buddy(0) == 0;
+    destroy_buddy_allocator();
+
+    passed = passed && init_buddy_allocator() == 0;
+    printTest(passed, "Double free of a buddy half");
+}
+
+// Helper function to count the resident pages of a page aligned range
+size_t resident_pages(void *start, size_t length)
+{
+    unsigned char vec[256];
+    size_t pages = length / PAGE_SIZE;
+    size_t count = 0;
+    if (pages > sizeof(vec) || mincore(start, length, vec) == -1)
+    {
+        return (size_t)-1;
+    }
+    for (size_t i = 0; i < pages; i++)
+    {
+        count += vec[i] & 1;
+    }
+    return count;
+}
+
+void test_trim_and_decay()
+{
+    BuddyConfig config = {0};
+    config.arena_size = BUDDY_MEMORY_SIZE;
+    config.small_threshold = BUDDY_MEMORY_SIZE / 2;
+    config.max_arenas = 1;
+    destroy_buddy_allocator();
+    bool passed = init_buddy_allocator_config(&config) == 0;
+    size_t length = BUDDY_MEMORY_SIZE / 4;
+    pseudo_set_decay_time(3600 * 1000);
+
+    // A freed block stays resident until it decays or is trimmed, its first page keeps the free list links
+    unsigned char *block = pseudo_malloc(length);
+    passed = passed && block != NULL;
+    if (passed)
+    {
+        memset(block, 1, length);
+        passed = pseudo_free(block) != -1 && resident_pages(block, length) == length / PAGE_SIZE;
+        passed = passed && pseudo_malloc_trim() >= length - PAGE_SIZE && resident_pages(block + PAGE_SIZE, length - PAGE_SIZE) == 0;
+        MallocStats stats;
+        pseudo_malloc_stats(&stats);
+        passed = passed && stats.purged_bytes >= length - PAGE_SIZE;
+    }
+
+    // The purged pages come back zeroed and usable, with no decay time they are purged by free itself
+    pseudo_set_decay_time(0);
+    block = pseudo_malloc(length);
+    passed = passed && block != NULL;
+    if (passed)
+    {
+        memset(block, 2, length);
+        passed = block[length - 1] == 2 && resident_pages(block, length) == length / PAGE_SIZE;
+        passed = passed && pseudo_free(block) != -1 && resident_pages(block + PAGE_SIZE, length - PAGE_SIZE) == 0;
+    }
+    pseudo_set_decay_time(DECAY_TIME_MS);
+    destroy_buddy_allocator();
+
+    passed = passed && init_buddy_allocator() == 0;
+    printTest(passed, "Trim and decay of free blocks");
+}
+
+void test_bitmap_search()
+{
+    pseudo_flush_thread_cache();
+    bool passed = !is_bitmap_full();
+    int count = BUDDY_MEMORY_SIZE / MIN_BLOCK_SIZE;
+    void **ptrs = malloc(count * sizeof(void *));
+    for (int i = 0; i < count; i++)
+    {
+        ptrs[i] = pseudo_malloc(MIN_BLOCK_SIZE);
+        // The word and SIMD search must agree with a bit by bit search
+        if (i % 97 == 0)
+        {
+            int expected = 0;
+            while (expected < 2 * count - 1 && get_bitmap(expected))
+            {
+                expected++;
+            }
+            if (expected == 2 * count - 1)
+            {
+                expected = -1;
+            }
+            if (find_free_buddy(0) != expected)
+            {
+                passed = false;
+            }
+        }
+    }
+    // Every leaf is allocated and every inner node is split
+    if (!is_bitmap_full() || find_free_buddy(0) != -1)
+    {
+        passed = false;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (pseudo_free(ptrs[i]) == -1)
+        {
+            passed = false;
+        }
+    }
+    free(ptrs);
+    pseudo_flush_thread_cache();
+    passed = passed && !is_bitmap_full() && find_free_buddy(0) == 0;
+    printTest(passed, "Bitmap search and full detection");
+}
+
+void test_working_set_beyond_one_arena()
+{
+    bool passed = true;
+    int count = 3 * (BUDDY_MEMORY_SIZE / MIN_BLOCK_SIZE);
+    void **ptrs = malloc(count * sizeof(void *));
+    for (int i = 0; i < count; i++)
+    {
+        ptrs[i] = pseudo_malloc(MIN_BLOCK_SIZE);
+        // Buddy blocks are aligned to their size, large allocations are not
+        if (ptrs[i] == NULL || (size_t)ptrs[i] % MIN_BLOCK_SIZE != 0)
+        {
+            passed = false;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (pseudo_free(ptrs[i]) == -1)
+        {
+            passed = false;
+        }
+    }
+    free(ptrs);
+    printTest(passed, "Working set beyond one arena");
+}
+
+void test_slab_size_classes()
+{
+    bool passed = true;
+    for (size_t size = 1; size <= 128; size++)
+    {
+        unsigned char *ptr = pseudo_malloc(size);
+        size_t align = 8;
+        while (align < size)
+        {
+            align *= 2;
+        }
+        // Slab objects are aligned to their size class
+        if (ptr == NULL || (size_t)ptr % align != 0)
+        {
+            passed = false;
+            continue;
+        }
+        memset(ptr, 0xCD, size);
+        if (pseudo_free(ptr + 1) != -1 || pseudo_free(ptr) == -1 || pseudo_free(ptr) != -1)
+        {
+            passed = false;
+        }
+    }
+    printTest(passed, "Slab size classes");
+}
+
+void test_slab_packing()
+{
+    bool passed = true;
+    unsigned char *ptrs[400];
+    unsigned char *lowest = NULL;
+    unsigned char *highest = NULL;
+    for (int i = 0; i < 400; i++)
+    {
+        ptrs[i] = pseudo_malloc(8);
+        if (ptrs[i] == NULL)
+        {
+            passed = false;
+            break;
+        }
+        memset(ptrs[i], i & 0xFF, 8);
+        lowest = lowest == NULL || ptrs[i] < lowest ? ptrs[i] : lowest;
+        highest = highest == NULL || ptrs[i] > highest ? ptrs[i] : highest;
+    }
+    // 400 objects of 8 bytes share a few pages instead of taking a 256-byte block each
+    passed = passed && (size_t)(highest - lowest) < 4 * PAGE_SIZE;
+    for (int i = 0; i < 400 && passed; i++)
+    {
+        if (ptrs[i][7] != (i & 0xFF) || pseudo_free(ptrs[i]) == -1)
+        {
+            passed = false;
+        }
+    }
+    printTest(passed, "Slab packing");
+}
+
+void test_large_cache_reuse()
+{
+    LargeCacheStats before, after;
+    pseudo_large_cache_stats(&before);
+    void *first = pseudo_malloc(16000);
+    bool passed = first != NULL && pseudo_free(first) != -1;
+    // The mapping is kept and handed out again to the next request of the same page count
+    void *second = pseudo_malloc(16000);
+    pseudo_large_cache_stats(&after);
+    passed = passed && second == first && after.hits == before.hits + 1;
+    memset(second, 0x5A, 16000);
+    if (pseudo_free(second) == -1)
+    {
+        passed = false;
+    }
+    printTest(passed, "Large cache reuse");
+}
+
+void test_large_cache_budget()
+{
+    LargeCacheStats stats;
+    pseudo_set_large_cache_budget(0);
+    void *ptr = pseudo_malloc(32000);
+    bool passed = ptr != NULL;
+    memset(ptr, 0x5A, 32000);
+    if (pseudo_free(ptr) == -1)
+    {
+        passed = false;
+    }
+    // Without a budget the mapping stays cached but its pages go back to the kernel
+    pseudo_large_cache_stats(&stats);
+    passed = passed && stats.resident_bytes == 0 && stats.cached_bytes >= 32000;
+    ptr = pseudo_malloc(32000);
+    passed = passed && ptr != NULL;
+    memset(ptr, 0xA5, 32000);
+    if (pseudo_free(ptr) == -1)
+    {
+        passed = false;
+    }
+    pseudo_set_large_cache_budget(8 << 20);
+    printTest(passed, "Large cache budget");
+}
+
+void test_huge_pages()
+{
+    size_t size = 3 << 20;
+    pseudo_set_huge_pages(true);
+    unsigned char *ptr = pseudo_malloc(size);
+    bool passed = ptr != NULL;
+    if (ptr != NULL)
+    {
+        // The mapping starts on a huge page boundary
+        passed = ((size_t)ptr & ((2 << 20) - 1)) == 0;
+        memset(ptr, 0x3C, size);
+        passed = passed && ptr[0] == 0x3C && ptr[size - 1] == 0x3C;
+        if (pseudo_free(ptr) == -1)
+        {
+            passed = false;
+        }
+    }
+    pseudo_set_huge_pages(false);
+    printTest(passed, "Huge pages");
+}
+
+#define HUGE_ARENA_BLOCKS 3000
+
+// Arenas committed in steps of 2 MB with huge pages enabled, which the system may not have reserved any of
+void test_huge_page_arenas()
+{
+    BuddyConfig config = {0};
+    unsigned char **ptrs = malloc(HUGE_ARENA_BLOCKS * sizeof(unsigned char *));
+    destroy_buddy_allocator();
+    pseudo_set_huge_pages(true);
+    config.arena_size = 4 << 20;
+    config.commit_size = 2 << 20;
+    bool passed = ptrs != NULL && init_buddy_allocator_config(&config) == 0;
+    unsigned char *lowest = NULL;
+    unsigned char *highest = NULL;
+    // Blocks of 1 KB for 3 MB, the arena commits its second 2 MB on the way
+    for (int i = 0; i < HUGE_ARENA_BLOCKS && passed; i++)
+    {
+        ptrs[i] = pseudo_malloc(1000);
+        passed = ptrs[i] != NULL;
+        if (passed)
+        {
+            memset(ptrs[i], i & 0xFF, 1000);
+            lowest = lowest == NULL || ptrs[i] < lowest ? ptrs[i] : lowest;
+            highest = highest == NULL || ptrs[i] > highest ? ptrs[i] : highest;
+        }
+    }
+    // They all come from the arena, not from mappings of their own
+    passed = passed && (size_t)(highest - lowest) < config.arena_size;
+    for (int i = 0; i < HUGE_ARENA_BLOCKS && passed; i++)
+    {
+        passed = ptrs[i][0] == (i & 0xFF) && ptrs[i][999] == (i & 0xFF) && pseudo_free(ptrs[i]) != -1;
+    }
+    free(ptrs);
+    destroy_buddy_allocator();
+    pseudo_set_huge_pages(false);
+    // Initialized again even if the test failed, the next tests need the allocator
+    passed = init_buddy_allocator() == 0 && passed;
+    printTest(passed, "Huge pages for arenas");
+}
+
+// Helper to fill a block with a pattern that depends on the position of each byte
+void fill_pattern(unsigned char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        ptr[i] = (unsigned char)(i * 7);
+    }
+}
+
+// Helper to check that the first size bytes of a block hold the pattern of fill_pattern
+bool check_pattern(unsigned char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (ptr[i] != (unsigned char)(i * 7))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_realloc_in_place()
+{
+    // With every cached block back in the arena the buddies of a new block are free
+    pseudo_flush_thread_cache();
+    unsigned char *ptr = pseudo_malloc(300);
+    pseudo_flush_thread_cache();
+    bool passed = ptr != NULL;
+    fill_pattern(ptr, 300);
+    unsigned char *grown = pseudo_realloc(ptr, 2000);
+    passed = passed && grown == ptr && check_pattern(grown, 300);
+    fill_pattern(grown, 2000);
+    // Shrinking splits the block and gives the upper halves back
+    unsigned char *shrunk = pseudo_realloc(grown, 200);
+    passed = passed && shrunk == ptr && check_pattern(shrunk, 200);
+    void *neighbour = pseudo_malloc(1000);
+    passed = passed && neighbour != NULL && (neighbour >= (void *)(shrunk + 200) || (unsigned char *)neighbour + 1000 <= shrunk);
+    pseudo_free(neighbour);
+    if (pseudo_free(shrunk) == -1)
+    {
+        passed = false;
+    }
+    printTest(passed, "Realloc in place");
+}
+
+void test_realloc_moves()
+{
+    // Slab object to buddy block to large mapping and back, the contents must follow
+    unsigned char *ptr = pseudo_malloc(40);
+    fill_pattern(ptr, 40);
+    bool passed = pseudo_realloc(ptr, 30) == ptr;
+    ptr = pseudo_realloc(ptr, 700);
+    passed = passed && ptr != NULL && check_pattern(ptr, 30);
+    fill_pattern(ptr, 700);
+    ptr = pseudo_realloc(ptr, 100000);
+    passed = passed && ptr != NULL && check_pattern(ptr, 700);
+    fill_pattern(ptr, 100000);
+    ptr = pseudo_realloc(ptr, 5 << 20);
+    passed = passed && ptr != NULL && check_pattern(ptr, 100000);
+    fill_pattern(ptr, 5 << 20);
+    unsigned char *shrunk = pseudo_realloc(ptr, 10000);
+    passed = passed && shrunk == ptr && check_pattern(shrunk, 10000);
+    ptr = pseudo_realloc(shrunk, 20);
+    passed = passed && ptr != NULL && check_pattern(ptr, 20);
+    passed = passed && pseudo_realloc(ptr, 0) == NULL;
+    ptr = pseudo_realloc(NULL, 64);
+    passed = passed && ptr != NULL && pseudo_free(ptr) != -1;
+    printTest(passed, "Realloc moves");
+}
+
+void test_realloc_overflow()
+{
+    bool passed = true;
+    // Sizes whose rounding to pages or to huge pages wraps around, the block stays as it was
+    size_t sizes[] = {SIZE_MAX - 10, SIZE_MAX - (1 << 20)};
+    for (int huge = 0; huge < 2; huge++)
+    {
+        pseudo_set_huge_pages(huge);
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            unsigned char *ptr = pseudo_malloc(5000);
+            passed = passed && ptr != NULL;
+            if (ptr == NULL)
+            {
+                continue;
+            }
+            memset(ptr, 0x42, 5000);
+            errno = 0;
+            passed = passed && pseudo_realloc(ptr, sizes[i]) == NULL && errno == ENOMEM;
+            passed = passed && ptr[4999] == 0x42 && pseudo_free(ptr) != -1;
+        }
+    }
+    pseudo_set_huge_pages(false);
+    printTest(passed, "Realloc to a size that overflows");
+}
+
+void test_aligned_alloc()
+{
+    size_t alignments[] = {16, 64, 256, 4096, 65536, 2 << 20};
+    size_t sizes[] = {24, 100, 700, 4096, 10000};
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); i++)
+    {
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+        {
+            unsigned char *ptr = pseudo_memalign(alignments[i], sizes[j]);
+            if (ptr == NULL || ((size_t)ptr & (alignments[i] - 1)) != 0)
+            {
+                passed = false;
+                continue;
+            }
+            memset(ptr, 0x77, sizes[j]);
+            if (pseudo_free(ptr) == -1)
+            {
+                passed = false;
+            }
+        }
+    }
+    // Aligned mappings can be resized like any large block
+    unsigned char *ptr = pseudo_aligned_alloc(4096, 8192);
+    passed = passed && ptr != NULL && ((size_t)ptr & 4095) == 0;
+    fill_pattern(ptr, 8192);
+    ptr = pseudo_realloc(ptr, 1 << 20);
+    passed = passed && ptr != NULL && check_pattern(ptr, 8192);
+    passed = passed && pseudo_free(ptr) != -1;
+    // Once freed the mapping is no longer known, so a double free is rejected
+    passed = passed && pseudo_free(ptr) == -1;
+    // Enough mappings to grow the table, freed out of order
+    void *ptrs[300];
+    for (int i = 0; i < 300; i++)
+    {
+        ptrs[i] = pseudo_memalign(4096, 4096);
+        passed = passed && ptrs[i] != NULL;
+    }
+    for (int i = 0; i < 300; i++)
+    {
+        passed = passed && pseudo_free(ptrs[(i * 7) % 300]) != -1;
+    }
+    passed = passed && pseudo_memalign(48, 100) == NULL && pseudo_aligned_alloc(64, 100) == NULL;
+    printTest(passed, "Aligned allocations");
+}
+
+void test_aligned_alloc_overflow()
+{
+    bool passed = true;
+    // Sizes whose rounded length overflows, with alignments below and above a page
+    size_t sizes[] = {SIZE_MAX - 100, SIZE_MAX - (1 << 20), SIZE_MAX / 2 + 1};
+    size_t alignments[] = {16, PAGE_SIZE, 8192, 1 << 21};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        for (size_t j = 0; j < sizeof(alignments) / sizeof(alignments[0]); j++)
+        {
+            errno = 0;
+            passed = passed && pseudo_memalign(alignments[j], sizes[i]) == NULL && errno == ENOMEM;
+        }
+        errno = 0;
+        passed = passed && pseudo_malloc(sizes[i]) == NULL && errno == ENOMEM;
+    }
+    printTest(passed, "Aligned alloc of a size that overflows");
+}
+
+#define FULL_ARENA_BLOCKS 16
+
+// Aligned requests below a threshold of 256 KB, once the only arena is full
+void test_aligned_alloc_full_arena()
+{
+    BuddyConfig config = {0};
+    void *blocks[FULL_ARENA_BLOCKS];
+    destroy_buddy_allocator();
+    config.small_threshold = 256 << 10;
+    config.max_arenas = 1;
+    bool passed = init_buddy_allocator_config(&config) == 0;
+    // Twice the blocks of 128 KB the arena holds, the last ones are large mappings
+    for (int i = 0; i < FULL_ARENA_BLOCKS; i++)
+    {
+        blocks[i] = pseudo_malloc(128 << 10);
+        passed = passed && blocks[i] != NULL;
+    }
+    for (int i = 0; i < 50 && passed; i++)
+    {
+        size_t alignment = (size_t)PAGE_SIZE << (1 + i % 5);
+        void *ptr = pseudo_memalign(alignment, 100);
+        passed = ptr != NULL && (uintptr_t)ptr % alignment == 0 && pseudo_free(ptr) != -1;
+    }
+    for (int i = 0; i < FULL_ARENA_BLOCKS; i++)
+    {
+        passed = pseudo_free(blocks[i]) != -1 && passed;
+    }
+    destroy_buddy_allocator();
+    // Initialized again even if the test failed, the next tests need the allocator
+    passed = init_buddy_allocator() == 0 && passed;
+    printTest(passed, "Aligned alloc with the arenas full");
+}
+
+void test_large_exact_pages()
+{
+    LargeCacheStats before, after;
+    bool passed = true;
+    for (size_t pages = 1; pages <= 4; pages++)
+    {
+        // A first round leaves a mapping of this length in the cache, the second reuses its slot instead of evicting one
+        pseudo_free(pseudo_malloc(pages * 4096));
+        unsigned char *ptr = pseudo_malloc(pages * 4096);
+        passed = passed && ptr != NULL && ((size_t)ptr & 4095) == 0;
+        memset(ptr, 0x11, pages * 4096);
+        // The freed mapping goes to the cache, which shows it held exactly the pages asked for
+        pseudo_large_cache_stats(&before);
+        passed = passed && pseudo_free(ptr) != -1;
+        pseudo_large_cache_stats(&after);
+        passed = passed && after.cached_bytes - before.cached_bytes == pages * 4096;
+    }
+    printTest(passed, "Large blocks use exact pages");
+}
+
+void test_free_sized()
+{
+    size_t sizes[] = {8, 24, 100, 200, 700, 5000};
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        void *ptr = pseudo_malloc(sizes[i]);
+        passed = passed && ptr != NULL && pseudo_free_sized(ptr, sizes[i]) != -1;
+    }
+    // A wrong size falls back on the full lookup, a second free is still caught
+    void *ptr = pseudo_malloc(300);
+    passed = passed && pseudo_free_sized(ptr, 900) != -1;
+    passed = passed && pseudo_free_sized(ptr, 300) == -1;
+    printTest(passed, "Sized free");
+}
+
+#define BULK_COUNT 1000
+
+void test_bulk_alloc_free()
+{
+    void *ptrs[BULK_COUNT];
+    size_t sizes[] = {16, 48, 500, 3000};
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t allocated = pseudo_malloc_bulk(sizes[i], BULK_COUNT, ptrs);
+        passed = passed && allocated == BULK_COUNT;
+        for (int j = 0; j < BULK_COUNT; j++)
+        {
+            memset(ptrs[j], j & 0xFF, sizes[i]);
+        }
+        // No two blocks may overlap, each still holds its own pattern
+        for (int j = 0; j < BULK_COUNT; j++)
+        {
+            passed = passed && ((unsigned char *)ptrs[j])[0] == (j & 0xFF) && ((unsigned char *)ptrs[j])[sizes[i] - 1] == (j & 0xFF);
+        }
+        passed = passed && pseudo_free_bulk(ptrs, BULK_COUNT) != -1;
+    }
+    // Mixed blocks, with one pointer given twice
+    ptrs[0] = pseudo_malloc(40);
+    ptrs[1] = pseudo_malloc(600);
+    ptrs[2] = pseudo_malloc(20000);
+    ptrs[3] = ptrs[0];
+    passed = passed && pseudo_free_bulk(ptrs, 4) == -1;
+    passed = passed && pseudo_free(ptrs[1]) == -1;
+    printTest(passed, "Bulk alloc and free");
+}
+
+#define GEOMETRY_BLOCKS 2000
+
+void test_configurable_geometry()
+{
+    BuddyConfig config = {0};
+    bool passed = true;
+    // The environment overrides the defaults
+    setenv("PSEUDO_MALLOC_ARENA_SIZE", "4M", 1);
+    pseudo_default_config(&config);
+    unsetenv("PSEUDO_MALLOC_ARENA_SIZE");
+    passed = passed && config.arena_size == (4 << 20) && config.min_block_size == MIN_BLOCK_SIZE;
+
+    // A 16 MB arena that starts with 1 MB committed and serves requests up to 4 KB
+    destroy_buddy_allocator();
+    memset(&config, 0, sizeof(config));
+    config.arena_size = 16 << 20;
+    config.commit_size = 1 << 20;
+    config.small_threshold = 4096;
+    passed = passed && init_buddy_allocator_config(&config) == 0;
+    unsigned char **ptrs = pseudo_malloc(GEOMETRY_BLOCKS * sizeof(unsigned char *));
+    unsigned char *lowest = NULL;
+    unsigned char *highest = NULL;
+    for (int i = 0; i < GEOMETRY_BLOCKS; i++)
+    {
+        // 2000 bytes is a buddy block with this threshold, together they need the arena to grow to 4 MB
+        ptrs[i] = pseudo_malloc(2000);
+        passed = passed && ptrs[i] != NULL;
+        memset(ptrs[i], i & 0xFF, 2000);
+        lowest = lowest == NULL || ptrs[i] < lowest ? ptrs[i] : lowest;
+        highest = highest == NULL || ptrs[i] > highest ? ptrs[i] : highest;
+    }
+    // Blocks of the arena are packed, separate mappings would be spread over the address space
+    passed = passed && (size_t)(highest - lowest) < 2 * GEOMETRY_BLOCKS * 2048;
+    for (int i = 0; i < GEOMETRY_BLOCKS; i++)
+    {
+        passed = passed && ptrs[i][0] == (i & 0xFF) && ptrs[i][1999] == (i & 0xFF);
+        passed = passed && pseudo_free(ptrs[i]) != -1;
+    }
+    pseudo_free(ptrs);
+    destroy_buddy_allocator();
+
+    // Invalid geometries are refused
+    memset(&config, 0, sizeof(config));
+    config.arena_size = 3 << 20;
+    passed = passed && init_buddy_allocator_config(&config) == -1;
+    config.arena_size = 0;
+    config.min_block_size = 64;
+    passed = passed && init_buddy_allocator_config(&config) == -1;
+    // The reserved range of 64 arenas of 256 MB does not fit a 32-bit address space, 4 of them do
+    memset(&config, 0, sizeof(config));
+    config.arena_size = 256 << 20;
+    config.max_arenas = 64;
+    int ret = init_buddy_allocator_config(&config);
+    passed = passed && ret == (sizeof(size_t) == 4 ? -1 : 0);
+    if (ret == 0)
+    {
+        destroy_buddy_allocator();
+    }
+    config.max_arenas = 4;
+    passed = passed && init_buddy_allocator_config(&config) == 0;
+    destroy_buddy_allocator();
+
+    passed = passed && init_buddy_allocator() == 0;
+    printTest(passed, "Configurable geometry");
+}
+
+// Bulk calls on buddy orders above the ones the thread caches serve, with a threshold of a quarter of the arena
+void test_bulk_large_threshold()
+{
+    BuddyConfig config = {0};
+    void *ptrs[BULK_COUNT];
+    destroy_buddy_allocator();
+    config.arena_size = 4 << 20;
+    config.small_threshold = 1 << 20;
+    bool passed = init_buddy_allocator_config(&config) == 0;
+    // Fill the thread caches of a slab class and a buddy order first
+    pseudo_free(pseudo_malloc(8));
+    pseudo_free(pseudo_malloc(200));
+    size_t sizes[] = {40000, 300000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && passed; i++)
+    {
+        size_t allocated = pseudo_malloc_bulk(sizes[i], 4, ptrs);
+        passed = allocated == 4;
+        for (size_t j = 0; j < allocated; j++)
+        {
+            memset(ptrs[j], (int)j, sizes[i]);
+        }
+        for (size_t j = 0; j < allocated; j++)
+        {
+            passed = passed && ((unsigned char *)ptrs[j])[sizes[i] - 1] == j;
+        }
+        passed = passed && pseudo_free_bulk(ptrs, allocated) != -1;
+    }
+    // Giving a block twice is still caught
+    ptrs[0] = pseudo_malloc(40000);
+    ptrs[1] = ptrs[0];
+    passed = passed && ptrs[0] != NULL && pseudo_free_bulk(ptrs, 2) == -1;
+    destroy_buddy_allocator();
+    // Initialized again even if the test failed, the next tests need the allocator
+    passed = init_buddy_allocator() == 0 && passed;
+    printTest(passed, "Bulk calls with a large small threshold");
+}
+
+void test_usable_size()
+{
+    bool passed = pseudo_malloc_usable_size(NULL) == 0;
+    // A slab object, a buddy block and a large mapping each report the room of their block
+    size_t sizes[] = {5, 100, 700, 3 * PAGE_SIZE + 1};
+    size_t expected[] = {8, 128, 1024, 4 * PAGE_SIZE};
+    for (int i = 0; i < 4; i++)
+    {
+        void *ptr = pseudo_malloc(sizes[i]);
+        passed = passed && ptr != NULL && pseudo_malloc_usable_size(ptr) == expected[i];
+        pseudo_free(ptr);
+    }
+    printTest(passed, "Usable size");
+}
+
+// free of the C library, replaced by the one of Preload.c when the tests run under make check-preload
+void test_free_keeps_errno()
+{
+    bool preloaded = getenv("LD_PRELOAD") != NULL && strstr(getenv("LD_PRELOAD"), "libpseudomalloc") != NULL;
+    // Called through a pointer, the compiler assumes the builtin free leaves errno alone and would not read it again
+    void (*volatile release)(void *) = free;
+    void *small = malloc(100);
+    void *large = malloc(1 << 20);
+    errno = EDOM;
+    release(small);
+    release(large);
+    bool passed = errno == EDOM;
+    if (preloaded)
+    {
+        // A double free of a cached block fails in pseudo_free, which sets errno, free must not report it
+        void *block = malloc(40);
+        release(block);
+        errno = EDOM;
+        release(block);
+        passed = passed && errno == EDOM;
+    }
+    printTest(passed, "Free keeps errno");
+}
+
+// Allocates blocks on a thread of its own, their counters stay after the thread exits
+void *stats_worker(void *arg)
+{
+    void **ptrs = arg;
+    for (int i = 0; i < 16; i++)
+    {
+        ptrs[i] = pseudo_malloc(700);
+    }
+    return NULL;
+}
+
+void test_malloc_stats()
+{
+    MallocStats before;
+    MallocStats after;
+    pseudo_malloc_stats(&before);
+    // Slab objects of 32 bytes, buddy blocks of order 2 and one large mapping of 4 pages
+    void *slab[10];
+    void *buddy[3];
+    for (int i = 0; i < 10; i++)
+    {
+        slab[i] = pseudo_malloc(24);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        buddy[i] = pseudo_malloc(700);
+    }
+    void *large = pseudo_malloc(3 * PAGE_SIZE + 1);
+    pseudo_malloc_stats(&after);
+    bool passed = after.slab_allocs[2] - before.slab_allocs[2] == 10 && after.buddy_allocs[2] - before.buddy_allocs[2] == 3;
+    passed = passed && after.arena_allocs - before.arena_allocs == 13 && after.large_allocs - before.large_allocs == 1;
+    passed = passed && after.requested_bytes - before.requested_bytes == 10 * 24 + 3 * 700 + 3 * PAGE_SIZE + 1;
+    passed = passed && after.granted_bytes - before.granted_bytes == 10 * 32 + 3 * 1024 + 4 * PAGE_SIZE;
+    passed = passed && after.bytes_in_use - before.bytes_in_use == 10 * 32 + 3 * 1024 + 4 * PAGE_SIZE;
+    passed = passed && after.peak_bytes_in_use >= after.bytes_in_use && after.bytes_mapped >= after.bytes_in_use;
+    passed = passed && after.fragmentation > 0 && after.fragmentation < 1;
+
+    for (int i = 0; i < 10; i++)
+    {
+        pseudo_free(slab[i]);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        pseudo_free(buddy[i]);
+    }
+    pseudo_free(large);
+    pseudo_malloc_stats(&after);
+    passed = passed && after.slab_frees[2] - before.slab_frees[2] == 10 && after.buddy_frees[2] - before.buddy_frees[2] == 3;
+    passed = passed && after.large_frees - before.large_frees == 1 && after.bytes_in_use == before.bytes_in_use;
+
+    // The counters of an exited thread are kept
+    void *ptrs[16];
+    pthread_t thread;
+    pthread_create(&thread, NULL, stats_worker, ptrs);
+    pthread_join(thread, NULL);
+    pseudo_malloc_stats(&before);
+    passed = passed && before.buddy_allocs[2] - after.buddy_allocs[2] == 16;
+    for (int i = 0; i < 16; i++)
+    {
+        pseudo_free(ptrs[i]);
+    }
+
+    // The JSON dump reports the length of the whole object even when it is cut
+    char json[4096];
+    size_t length = pseudo_malloc_stats_json(json, sizeof(json));
+    passed = passed && length == strlen(json) && json[0] == '{' && json[length - 1] == '}' && strstr(json, "\"large_allocs\": ") != NULL;
+    char cut[16];
+    passed = passed && pseudo_malloc_stats_json(cut, sizeof(cut)) >= sizeof(cut) && strlen(cut) == sizeof(cut) - 1;
+    printTest(passed, "Malloc statistics");
+}
+
+void test_trace()
+{
+    const char *path = "/tmp/pseudo_malloc_test.trace";
+    bool passed = pseudo_trace_stop() == -1 && pseudo_trace_start(path) == 0 && pseudo_trace_start(path) == -1;
+    void *a = pseudo_malloc(40);
+    void *b = pseudo_memalign(256, 300);
+    void *c = pseudo_realloc(a, 2000);
+    pseudo_free(b);
+    pseudo_free(c);
+    passed = passed && pseudo_trace_stop() == 0;
+
+    // The calls made inside realloc are not traced, only the realloc itself
+    TraceHeader header;
+    TraceRecord records[8];
+    FILE *file = fopen(path, "rb");
+    passed = passed && file != NULL && fread(&header, sizeof(header), 1, file) == 1;
+    size_t count = file != NULL ? fread(records, sizeof(TraceRecord), 8, file) : 0;
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    remove(path);
+    passed = passed && memcmp(header.magic, TRACE_MAGIC, 8) == 0 && header.record_size == sizeof(TraceRecord) && count == 5;
+    if (passed)
+    {
+        passed = TRACE_OP(records[0].info) == TRACE_MALLOC && records[0].ptr == (uintptr_t)a && TRACE_SIZE(records[0].info) == 40;
+        passed = passed && TRACE_OP(records[1].info) == TRACE_MEMALIGN && records[1].aux == 256 && TRACE_SIZE(records[1].info) == 300;
+        passed = passed && TRACE_OP(records[2].info) == TRACE_REALLOC && records[2].aux == (uintptr_t)a && records[2].ptr == (uintptr_t)c;
+        passed = passed && TRACE_OP(records[3].info) == TRACE_FREE && records[3].ptr == (uintptr_t)b;
+        passed = passed && TRACE_OP(records[4].info) == TRACE_FREE && records[4].ptr == (uintptr_t)c;
+        passed = passed && records[0].time <= records[4].time;
+    }
+    printTest(passed, "Allocation trace");
+}
+
+void test_large_offsets()
+{
+    // The largest arena of the word size, an 8 GB arena puts blocks past 4 GB on 64-bit
+    size_t arena = sizeof(void *) == 8 ? (size_t)8 << 30 : (size_t)256 << 20;
+    BuddyConfig config = {0};
+    config.arena_size = arena;
+    config.min_block_size = 4096;
+    config.small_threshold = arena;
+    config.max_arenas = 1;
+    destroy_buddy_allocator();
+    bool passed = init_buddy_allocator_config(&config) == 0;
+
+    // The first block takes the lower half, the second is split from the upper half
+    unsigned char *low = pseudo_malloc(arena / 8 * 3);
+    unsigned char *high = pseudo_malloc(arena / 8);
+    passed = passed && low != NULL && high != NULL;
+    if (passed)
+    {
+        passed = (size_t)(high - low) >= arena / 2;
+        // Only the ends are touched so the pages of the middle are never faulted in
+        low[0] = 1;
+        low[arena / 8 * 3 - 1] = 2;
+        high[0] = 3;
+        high[arena / 8 - 1] = 4;
+        passed = passed && low[0] == 1 && low[arena / 8 * 3 - 1] == 2 && high[0] == 3 && high[arena / 8 - 1] == 4;
+    }
+    passed = passed && pseudo_free(high) != -1 && pseudo_free(low) != -1;
+    destroy_buddy_allocator();
+
+    passed = passed && init_buddy_allocator() == 0;
+    printTest(passed, "Large arena offsets");
+}
+
+#define THREAD_TEST_THREADS 8
+#define THREAD_TEST_ROUNDS 20000
+
+void *thread_allocation_worker(void *arg)
+{
+    unsigned int seed = (unsigned int)(size_t)arg;
+    unsigned char *ptrs[32] = {0};
+    size_t sizes[32] = {0};
+    long errors = 0;
+    for (int i = 0; i < THREAD_TEST_ROUNDS; i++)
+    {
+        int slot = rand_r(&seed) % 32;
+        if (ptrs[slot] != NULL)
+        {
+            // The block must still hold the pattern written by this thread
+            for (size_t j = 0; j < sizes[slot]; j++)
+            {
+                if (ptrs[slot][j] != (unsigned char)slot)
+                {
+                    errors++;
+                    break;
+                }
+            }
+            if (pseudo_free(ptrs[slot]) == -1)
+            {
+                errors++;
+            }
+            ptrs[slot] = NULL;
+        }
+        else
+        {
+            sizes[slot] = 1 + rand_r(&seed) % (PAGE_SIZE / 2);
+            ptrs[slot] = pseudo_malloc(sizes[slot]);
+            if (ptrs[slot] == NULL)
+            {
+                errors++;
+                continue;
+            }
+            memset(ptrs[slot], slot, sizes[slot]);
+        }
+    }
+    for (int slot = 0; slot < 32; slot++)
+    {
+        if (ptrs[slot] != NULL && pseudo_free(ptrs[slot]) == -1)
+        {
+            errors++;
+        }
+    }
+    return (void *)errors;
+}
+
+void test_concurrent_allocations()
+{
+    bool passed = true;
+    pthread_t threads[THREAD_TEST_THREADS];
+    for (int i = 0; i < THREAD_TEST_THREADS; i++)
+    {
+        if (pthread_create(&threads[i], NULL, thread_allocation_worker, (void *)(size_t)(i + 1)) != 0)
+        {
+            passed = false;
+        }
+    }
+    for (int i = 0; i < THREAD_TEST_THREADS; i++)
+    {
+        void *errors;
+        pthread_join(threads[i], &errors);
+        if (errors != NULL)
+        {
+            passed = false;
+        }
+    }
+    // The caches of the exited threads went back to the buddy memory
+    pseudo_flush_thread_cache();
+    passed = passed && find_free_buddy(0) == 0;
+    printTest(passed, "Concurrent allocations");
+}
+
+#define REINIT_BLOCKS 40
+
+// Thread that fills its cache, waits for the allocator to be destroyed and initialized again, then allocates
+void *reinit_worker(void *arg)
+{
+    pthread_barrier_t *barrier = arg;
+    void *ptrs[REINIT_BLOCKS];
+    long errors = 0;
+    for (int i = 0; i < REINIT_BLOCKS; i++)
+    {
+        ptrs[i] = pseudo_malloc(i % 2 ? 24 : 300);
+    }
+    for (int i = 0; i < REINIT_BLOCKS; i++)
+    {
+        pseudo_free(ptrs[i]);
+    }
+    pthread_barrier_wait(barrier);
+    pthread_barrier_wait(barrier);
+    // The blocks cached before the destroy are gone, every block comes from the new arenas
+    for (int i = 0; i < REINIT_BLOCKS; i++)
+    {
+        ptrs[i] = pseudo_malloc(i % 2 ? 24 : 300);
+        if (ptrs[i] == NULL || !pseudo_in_arena(ptrs[i]))
+        {
+            errors++;
+            continue;
+        }
+        memset(ptrs[i], 0x5A, i % 2 ? 24 : 300);
+    }
+    for (int i = 0; i < REINIT_BLOCKS; i++)
+    {
+        if (ptrs[i] != NULL && pseudo_free(ptrs[i]) == -1)
+        {
+            errors++;
+        }
+    }
+    return (void *)errors;
+}
+
+void test_reinit_with_live_threads()
+{
+    pthread_barrier_t barrier;
+    pthread_t thread;
+    void *errors = NULL;
+    pthread_barrier_init(&barrier, NULL, 2);
+    bool passed = pthread_create(&thread, NULL, reinit_worker, &barrier) == 0;
+    if (passed)
+    {
+        pthread_barrier_wait(&barrier);
+        destroy_buddy_allocator();
+        passed = init_buddy_allocator() == 0;
+        // The new arena starts with blocks the old cache also pointed to, this thread writes over them
+        unsigned char *block = pseudo_malloc(300);
+        pthread_barrier_wait(&barrier);
+        pthread_join(thread, &errors);
+        passed = passed && errors == NULL && block != NULL && block[0] != 0x5A && pseudo_free(block) != -1;
+    }
+    pthread_barrier_destroy(&barrier);
+    // The exited thread gave its blocks back, the arena merges into one block again
+    pseudo_flush_thread_cache();
+    passed = passed && find_free_buddy(0) == 0;
+    printTest(passed, "Destroy with live threads");
+}
+
+#define LARGE_REALLOC_ROUNDS 10000
+
+void *large_realloc_worker(void *arg)
+{
+    unsigned int seed = (unsigned int)(size_t)arg;
+    long errors = 0;
+    for (int i = 0; i < LARGE_REALLOC_ROUNDS; i++)
+    {
+        size_t size = PAGE_SIZE + rand_r(&seed) % (5 * PAGE_SIZE);
+        unsigned char *ptr = rand_r(&seed) % 2 ? pseudo_malloc(size) : pseudo_memalign(PAGE_SIZE, size);
+        if (ptr == NULL)
+        {
+            errors++;
+            continue;
+        }
+        ptr[0] = (unsigned char)i;
+        // Moving mappings give their old range back while other threads map new ones
+        size_t new_size = PAGE_SIZE + rand_r(&seed) % (5 * PAGE_SIZE);
+        unsigned char *moved = pseudo_realloc(ptr, new_size);
+        if (moved == NULL)
+        {
+            errors++;
+            moved = ptr;
+        }
+        else if (moved[0] != (unsigned char)i)
+        {
+            errors++;
+        }
+        if (pseudo_free(moved) == -1)
+        {
+            errors++;
+        }
+    }
+    return (void *)errors;
+}
+
+void test_concurrent_large_realloc()
+{
+    MallocStats before, after;
+    pseudo_malloc_stats(&before);
+    bool passed = true;
+    pthread_t threads[THREAD_TEST_THREADS];
+    for (int i = 0; i < THREAD_TEST_THREADS; i++)
+    {
+        passed = passed && pthread_create(&threads[i], NULL, large_realloc_worker, (void *)(size_t)(i + 1)) == 0;
+    }
+    for (int i = 0; i < THREAD_TEST_THREADS; i++)
+    {
+        void *errors;
+        pthread_join(threads[i], &errors);
+        passed = passed && errors == NULL;
+    }
+    // Every large mapping made by the threads was freed
+    pseudo_malloc_stats(&after);
+    passed = passed && after.large_allocs - before.large_allocs == after.large_frees - before.large_frees;
+    printTest(passed, "Concurrent large realloc");
+}
+
+#define HANDOFF_BLOCKS 2000
+
+void *handoff_producer(void *arg)
+{
+    unsigned char **ptrs = arg;
+    for (int i = 0; i < HANDOFF_BLOCKS; i++)
+    {
+        ptrs[i] = pseudo_malloc(1 + i % 500);
+        if (ptrs[i] != NULL)
+        {
+            memset(ptrs[i], i & 0xFF, 1 + i % 500);
+        }
+    }
+    return NULL;
+}
+
+void *handoff_consumer(void *arg)
+{
+    unsigned char **ptrs = arg;
+    long errors = 0;
+    for (int i = 0; i < HANDOFF_BLOCKS; i++)
+    {
+        if (ptrs[i] == NULL || ptrs[i][i % 500] != (i & 0xFF) || pseudo_free(ptrs[i]) == -1)
+        {
+            errors++;
+        }
+    }
+    return (void *)errors;
+}
+
+void test_cross_thread_free()
+{
+    bool passed = true;
+    unsigned char *ptrs[HANDOFF_BLOCKS];
+    for (int round = 0; round < 3 && passed; round++)
+    {
+        // Blocks allocated by one thread are freed by another one that never allocated
+        pthread_t producer, consumer;
+        void *errors;
+        pthread_create(&producer, NULL, handoff_producer, ptrs);
+        pthread_join(producer, NULL);
+        pthread_create(&consumer, NULL, handoff_consumer, ptrs);
+        pthread_join(consumer, &errors);
+        passed = errors == NULL;
+    }
+    printTest(passed, "Cross thread free");
+}
+
+#define POOL_TEST_OBJECTS 5000
+
+void test_object_pool()
+{
+    pseudo_flush_thread_cache();
+    bool passed = pseudo_pool_create(0, 8) == NULL && pseudo_pool_create(24, 3) == NULL;
+    PseudoPool *pool = pseudo_pool_create(24, 8);
+    PseudoPool *aligned = pseudo_pool_create(100, 64);
+    void **objects = malloc(POOL_TEST_OBJECTS * sizeof(void *));
+    passed = passed && pool != NULL && aligned != NULL && objects != NULL;
+    // Objects span several blocks, each keeps what was written in it
+    for (int i = 0; i < POOL_TEST_OBJECTS && passed; i++)
+    {
+        objects[i] = pseudo_pool_alloc(pool);
+        passed = objects[i] != NULL && (uintptr_t)objects[i] % 8 == 0;
+        if (passed)
+        {
+            memset(objects[i], i & 0xFF, 24);
+        }
+    }
+    for (int i = 0; i < POOL_TEST_OBJECTS && passed; i++)
+    {
+        passed = ((unsigned char *)objects[i])[0] == (i & 0xFF) && ((unsigned char *)objects[i])[23] == (i & 0xFF);
+    }
+    // Freed objects are handed out again, the last freed first
+    for (int i = 0; i < POOL_TEST_OBJECTS && passed; i += 2)
+    {
+        pseudo_pool_free(pool, objects[i]);
+    }
+    for (int i = POOL_TEST_OBJECTS - 2; i >= 0 && passed; i -= 2)
+    {
+        passed = pseudo_pool_alloc(pool) == objects[i];
+    }
+    for (int i = 0; i < 100 && passed; i++)
+    {
+        unsigned char *object = pseudo_pool_alloc(aligned);
+        passed = object != NULL && (uintptr_t)object % 64 == 0;
+        if (passed)
+        {
+            memset(object, 0xAB, 100);
+        }
+    }
+    // Destroying the pools gives every block back, the arena merges into one block again
+    pseudo_pool_destroy(pool);
+    pseudo_pool_destroy(aligned);
+    free(objects);
+    pseudo_flush_thread_cache();
+    passed = passed && find_free_buddy(0) == 0;
+    printTest(passed, "Object pool");
+}
+
+void test_inline_malloc()
+{
+    pseudo_flush_thread_cache();
+    MallocStats before, after;
+    pseudo_malloc_stats(&before);
+    // A variable size up to SLAB_MAX_SIZE gets the slab object pseudo_malloc would pick
+    bool passed = true;
+    size_t objects = 0;
+    for (size_t size = 1; size <= SLAB_MAX_SIZE && passed; size++)
+    {
+        void *ptr = pseudo_malloc_inline(size);
+        void *expected = pseudo_malloc(size);
+        passed = ptr != NULL && expected != NULL && pseudo_malloc_usable_size(ptr) == pseudo_malloc_usable_size(expected) &&
+                 pseudo_malloc_usable_size(ptr) == (size_t)8 << pseudo_slab_class(size);
+        if (passed)
+        {
+            memset(ptr, 0xCD, size);
+            objects += 2;
+        }
+        pseudo_free(ptr);
+        pseudo_free(expected);
+    }
+    // Constant sizes resolve their class at compile time, a node of two words is a 16 byte object
+    void *node = pseudo_malloc_inline(2 * sizeof(void *));
+    void *byte = pseudo_malloc_inline(1);
+    void *largest = pseudo_malloc_inline(SLAB_MAX_SIZE);
+    passed = passed && node != NULL && byte != NULL && largest != NULL &&
+             pseudo_malloc_usable_size(node) == 2 * sizeof(void *) && pseudo_malloc_usable_size(byte) == 8 &&
+             pseudo_malloc_usable_size(largest) == SLAB_MAX_SIZE;
+    pseudo_free(node);
+    pseudo_free(byte);
+    pseudo_free(largest);
+    objects += 3;
+    // Sizes past the slab classes and 0 take the path of pseudo_malloc
+    void *block = pseudo_malloc_inline(SLAB_MAX_SIZE + 1);
+    passed = passed && block != NULL && pseudo_malloc_usable_size(block) == MIN_BLOCK_SIZE;
+    pseudo_free(block);
+    passed = passed && pseudo_malloc_inline(0) == NULL;
+    // The fast path counts its allocations like pseudo_malloc
+    pseudo_flush_thread_cache();
+    pseudo_malloc_stats(&after);
+    size_t slab_allocs = 0;
+    for (int i = 0; i < STATS_SLAB_CLASSES; i++)
+    {
+        slab_allocs += after.slab_allocs[i] - before.slab_allocs[i];
+    }
+    passed = passed && slab_allocs == objects && after.bytes_in_use == before.bytes_in_use;
+    printTest(passed, "Inline malloc fast path");
+}
+
+#define REGION_TEST_ALLOCS 2000
+
+void test_region()
+{
+    pseudo_flush_thread_cache();
+    PseudoRegion *region = pseudo_region_create(0);
+    unsigned char *ptrs[REGION_TEST_ALLOCS];
+    bool passed = region != NULL;
+    // Allocations are aligned and keep their contents while the region grows over several chunks
+    for (int i = 0; i < REGION_TEST_ALLOCS && passed; i++)
+    {
+        size_t size = 1 + (i * 37) % 300;
+        ptrs[i] = pseudo_region_alloc(region, size);
+        passed = ptrs[i] != NULL && (uintptr_t)ptrs[i] % 16 == 0;
+        if (passed)
+        {
+            memset(ptrs[i], i & 0xFF, size);
+        }
+    }
+    for (int i = 0; i < REGION_TEST_ALLOCS && passed; i++)
+    {
+        size_t size = 1 + (i * 37) % 300;
+        passed = ptrs[i][0] == (i & 0xFF) && ptrs[i][size - 1] == (i & 0xFF);
+    }
+    // A rollback frees what was allocated after the mark, chunks and large requests included
+    PseudoRegionMark mark = pseudo_region_save(region);
+    unsigned char *first = pseudo_region_alloc(region, 64);
+    for (int i = 0; i < 1000 && passed; i++)
+    {
+        passed = pseudo_region_alloc(region, 1000) != NULL;
+    }
+    unsigned char *big = pseudo_region_alloc(region, 8 << 20);
+    passed = passed && big != NULL;
+    if (passed)
+    {
+        big[0] = 1;
+        big[(8 << 20) - 1] = 2;
+    }
+    pseudo_region_rollback(region, mark);
+    passed = passed && pseudo_region_alloc(region, 64) == first && ptrs[0][0] == 0;
+    // A reset keeps the newest chunk, the next allocation starts at its beginning
+    pseudo_region_reset(region);
+    unsigned char *start = pseudo_region_alloc(region, 1);
+    passed = passed && start != NULL && pseudo_region_alloc(region, 0) == start + 16;
+    pseudo_region_reset(region);
+    passed = passed && pseudo_region_alloc(region, 100) == start;
+    pseudo_region_destroy(region);
+    pseudo_flush_thread_cache();
+    passed = passed && find_free_buddy(0) == 0;
+    printTest(passed, "Region allocator");
+}
+
+#define STACK_TEST_ELEMENTS 100000
+
+void test_chunked_stack(bool pooled)
+{
+    Stack stack = pooled ? initializePooledStack() : initializeStack();
+    bool passed = stack != NULL;
+    for (int i = 0; i < STACK_TEST_ELEMENTS && passed; i++)
+    {
+        passed = insert(stack, i * 3) == 0;
+    }
+    // Every index is reached directly, whatever chunk it falls in
+    for (int i = 0; i < STACK_TEST_ELEMENTS && passed; i++)
+    {
+        passed = getElement(stack, i) == (STACK_TEST_ELEMENTS - 1 - i) * 3;
+    }
+    passed = passed && getElement(stack, STACK_TEST_ELEMENTS) == -1 && getElement(stack, -1) == -1;
+    // Pops go down through the chunks, pushes and pops around a chunk boundary keep the elements in order
+    for (int i = STACK_TEST_ELEMENTS - 1; i >= 1000 && passed; i--)
+    {
+        passed = pop(stack) == i * 3;
+    }
+    for (int round = 0; round < 100 && passed; round++)
+    {
+        passed = insert(stack, -5) == 0 && insert(stack, -7) == 0 && pop(stack) == -7 && pop(stack) == -5;
+        passed = passed && pop(stack) == 999 * 3 && insert(stack, 999 * 3) == 0;
+    }
+    for (int i = 0; i < 1000 && passed; i++)
+    {
+        passed = getElement(stack, i) == (999 - i) * 3;
+    }
+    while (passed && pop(stack) != -1)
+    {
+    }
+    passed = passed && getElement(stack, 0) == -1 && insert(stack, 42) == 0 && getElement(stack, 0) == 42;
+    passed = passed && destroyStack(stack) != -1;
+    printTest(passed, pooled ? "Chunked stack with a pool" : "Chunked stack");
+}
+
+#define SHARED_STACK_VALUES 20000 // Values pushed by each thread
+
+typedef struct SharedStackTest
+{
+    SharedStack stack;
+    int thread;
+    int values;          // Values pushed by the thread
+    unsigned char *seen; // Times each value was popped
+} SharedStackTest;
+
+void *shared_stack_worker(void *arg)
+{
+    SharedStackTest *test = arg;
+    // Two pushes for each pop, so the threads pop the values of the others as well as their own
+    for (int i = 0; i < test->values; i++)
+    {
+        sharedInsert(test->stack, test->thread * test->values + i);
+        int value = i % 2 == 1 ? sharedPop(test->stack) : -1;
+        if (value != -1)
+        {
+            __atomic_add_fetch(&test->seen[value], 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Helper function to push and pop values of a shared stack from threads, true if every value came out once
+bool run_shared_stack(SharedStack stack, int thread_count, int values)
+{
+    unsigned char *seen = calloc(thread_count * values, 1);
+    SharedStackTest tests[THREAD_TEST_THREADS];
+    pthread_t threads[THREAD_TEST_THREADS];
+    bool passed = seen != NULL && sharedPop(stack) == -1;
+    for (int i = 0; i < thread_count && passed; i++)
+    {
+        tests[i].stack = stack;
+        tests[i].thread = i;
+        tests[i].values = values;
+        tests[i].seen = seen;
+        passed = pthread_create(&threads[i], NULL, shared_stack_worker, &tests[i]) == 0;
+    }
+    for (int i = 0; i < thread_count && passed; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    // Every value pushed is popped exactly once, by a worker or here
+    for (int value = sharedPop(stack); passed && value != -1; value = sharedPop(stack))
+    {
+        seen[value]++;
+    }
+    for (int i = 0; i < thread_count * values && passed; i++)
+    {
+        passed = seen[i] == 1;
+    }
+    free(seen);
+    return passed;
+}
+
+void test_shared_stack()
+{
+    SharedStack stack = initializeSharedStack();
+    bool passed = stack != NULL && run_shared_stack(stack, THREAD_TEST_THREADS, SHARED_STACK_VALUES);
+    passed = passed && sharedInsert(stack, 7) == 0 && destroySharedStack(stack) != -1;
+    printTest(passed, "Shared stack");
+}
+
+#define FULL_ARENA_OBJECTS 8192 // More objects of 16 bytes than an arena of 64 KB holds
+#define SHARED_LARGE_VALUES 500
+
+// Shared stack whose nodes come from large mappings, the only arena being full
+void test_shared_stack_outside_arenas()
+{
+    BuddyConfig config = {0};
+    void **objects = malloc(FULL_ARENA_OBJECTS * sizeof(void *));
+    destroy_buddy_allocator();
+    config.arena_size = 16 * PAGE_SIZE;
+    config.max_arenas = 1;
+    bool passed = objects != NULL && init_buddy_allocator_config(&config) == 0;
+    int count = 0;
+    while (passed && count < FULL_ARENA_OBJECTS)
+    {
+        objects[count] = pseudo_malloc(16);
+        passed = objects[count] != NULL;
+        if (passed && !pseudo_in_arena(objects[count++]))
+        {
+            break;
+        }
+    }
+    passed = passed && count < FULL_ARENA_OBJECTS;
+    MallocStats before, after;
+    pseudo_malloc_stats(&before);
+    SharedStack stack = initializeSharedStack();
+    passed = passed && stack != NULL && run_shared_stack(stack, 4, SHARED_LARGE_VALUES);
+    // Popped nodes are mappings that could be unmapped under a concurrent pop, none was freed yet
+    pseudo_malloc_stats(&after);
+    passed = passed && after.large_frees == before.large_frees;
+    passed = passed && stack != NULL && destroySharedStack(stack) != -1;
+    pseudo_malloc_stats(&after);
+    passed = passed && after.large_allocs - before.large_allocs == after.large_frees - before.large_frees;
+    for (int i = 0; i < count; i++)
+    {
+        pseudo_free(objects[i]);
+    }
+    free(objects);
+    destroy_buddy_allocator();
+    // Initialized again even if the test failed, the next tests need the allocator
+    passed = init_buddy_allocator() == 0 && passed;
+    printTest(passed, "Shared stack outside the arenas");
+}
+
 void test_linked_list(){
     bool passed = true;
 
@@ -503,6 +1979,45 @@ int main()
     test_allocation_free_repeated();
     test_large_small_mixed();
     test_edge_case_exact_page();
+    test_buddy_blocks_do_not_alias();
+    test_buddy_coalesce();
+    test_bitmap_search();
+    test_working_set_beyond_one_arena();
+    test_slab_size_classes();
+    test_slab_packing();
+    test_large_cache_reuse();
+    test_large_cache_budget();
+    test_huge_pages();
+    test_huge_page_arenas();
+    test_realloc_in_place();
+    test_realloc_moves();
+    test_realloc_overflow();
+    test_aligned_alloc();
+    test_aligned_alloc_overflow();
+    test_aligned_alloc_full_arena();
+    test_large_exact_pages();
+    test_free_sized();
+    test_bulk_alloc_free();
+    test_concurrent_allocations();
+    test_reinit_with_live_threads();
+    test_cross_thread_free();
+    test_concurrent_large_realloc();
+    test_configurable_geometry();
+    test_bulk_large_threshold();
+    test_large_offsets();
+    test_usable_size();
+    test_free_keeps_errno();
+    test_malloc_stats();
+    test_trace();
+    test_buddy_double_free_of_half();
+    test_trim_and_decay();
+    test_chunked_stack(false);
+    test_chunked_stack(true);
+    test_object_pool();
+    test_inline_malloc();
+    test_region();
+    test_shared_stack();
+    test_shared_stack_outside_arenas();
     test_linked_list();
 
     